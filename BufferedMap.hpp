@@ -0,0 +1,340 @@
+#ifndef AWILLI64_BUFFEREDMAP_HPP
+#define AWILLI64_BUFFEREDMAP_HPP
+
+#include "Map.hpp"
+
+#include <vector>      //the sorted delta
+#include <algorithm>   //std::lower_bound into the delta
+#include <iterator>    //std::back_inserter
+#include <utility>
+#include <stdexcept>   //to throw std::out_of_range in at()
+
+namespace cs540 {
+  //Map that takes writes into an in-memory delta instead of the skip list. insert() and
+  //erase() append to a short log. A full log is sorted and merged into a sorted delta in
+  //one sequential pass. Once the delta holds capacity keys it is merged into the map with
+  //erase_sorted_batch() and insert_sorted_batch(). With the default capacity the keys of a
+  //batch lie close enough together that the map is walked once rather than searched per
+  //key. Point lookups scan the log newest first and binary search the delta before they
+  //look in the map, without merging anything. Everything that needs the entries in order
+  //(iteration, bounds, size) merges the delta first, so it sees the same entries as a
+  //plain Map would, and so does find() for a key with buffered writes.
+  //
+  //The delta keeps one entry per key with the net effect of the writes to it: an insert
+  //(kept only if the map doesn't have the key, as with Map::insert()), an erase, or a
+  //replace (an erase followed by inserts, which sets the value either way).
+  template <typename Key_T, typename Mapped_T>
+  class BufferedMap {
+  public:
+    typedef std::pair<const Key_T, Mapped_T>             ValueType;
+    typedef typename Map<Key_T, Mapped_T>::Iterator      Iterator;
+    typedef typename Map<Key_T, Mapped_T>::ConstIterator ConstIterator;
+
+    static const size_t DEFAULT_CAPACITY = 65536;
+    //writes appended before the log is sorted into the delta
+    static const size_t LOG_CAPACITY = 1024;
+
+    //Constructors
+    explicit BufferedMap (size_t capacity = DEFAULT_CAPACITY);
+    explicit BufferedMap (Map<Key_T, Mapped_T> &&, size_t capacity = DEFAULT_CAPACITY);
+    //************************************
+
+    //Size
+    size_t size  () const;
+    bool   empty () const;
+    //************************************
+
+    //Iterators
+    Iterator      begin ();
+    Iterator      end   ();
+    ConstIterator begin () const;
+    ConstIterator end   () const;
+    //************************************
+
+    //Element Access
+    //get_if() and at() return values that may live in the delta, valid until the next write
+    bool           contains    (const Key_T &) const;
+    const Mapped_T *get_if     (const Key_T &) const;
+    const Mapped_T &at         (const Key_T &) const;
+    ConstIterator  find        (const Key_T &) const;
+    ConstIterator  lower_bound (const Key_T &) const;
+    ConstIterator  upper_bound (const Key_T &) const;
+    //************************************
+
+    //Modifiers
+    //Neither reports whether the key was there: that would take the search they avoid.
+    //erase() needs a default constructible Mapped_T.
+    void insert (const ValueType &);
+    void erase  (const Key_T &);
+    void clear  ();
+    //merges the delta into the map now
+    void flush  () const;
+    //the map with the delta merged, for everything else Map offers
+    Map<Key_T, Mapped_T>       &merged ();
+    const Map<Key_T, Mapped_T> &merged () const;
+    //************************************
+
+  private:
+    enum Op { INSERT, ERASE, REPLACE };
+    struct Pending {
+      std::pair<Key_T, Mapped_T> entry; //the value is unused for ERASE
+      Op op;
+    };
+
+    bool        pendingFor (const Key_T &, Op &op, const Mapped_T *&value) const;
+    void        add        (Pending &&);
+    void        settle     () const;
+    static void fold       (Pending &into, const Pending &write);
+
+    //merging the log and the delta doesn't change what the map holds, so const members may do it
+    mutable Map<Key_T, Mapped_T> map;
+    mutable std::vector<Pending> delta;  //sorted by key, one entry per key
+    mutable std::vector<Pending> log;    //INSERTs and ERASEs in the order they were made
+    mutable std::vector<Pending> spare;  //reused as the target of the merges in settle()
+    size_t capacity;
+  }; //end class BufferedMap
+
+  template <typename Key_T, typename Mapped_T>
+  const size_t BufferedMap<Key_T, Mapped_T>::DEFAULT_CAPACITY;
+  template <typename Key_T, typename Mapped_T>
+  const size_t BufferedMap<Key_T, Mapped_T>::LOG_CAPACITY;
+
+  template <typename Key_T, typename Mapped_T>
+  BufferedMap<Key_T, Mapped_T>::BufferedMap(size_t capacityIn) : capacity(std::max<size_t>(1, capacityIn)) {
+    log.reserve(std::min(capacity, LOG_CAPACITY));
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  BufferedMap<Key_T, Mapped_T>::BufferedMap(Map<Key_T, Mapped_T> &&mapIn, size_t capacityIn) :
+    map(std::move(mapIn)), capacity(std::max<size_t>(1, capacityIn)) {
+    log.reserve(std::min(capacity, LOG_CAPACITY));
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  size_t BufferedMap<Key_T, Mapped_T>::size() const {
+    flush();
+    return map.size();
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  bool BufferedMap<Key_T, Mapped_T>::empty() const {
+    flush();
+    return map.empty();
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename BufferedMap<Key_T, Mapped_T>::Iterator BufferedMap<Key_T, Mapped_T>::begin() {
+    flush();
+    return map.begin();
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename BufferedMap<Key_T, Mapped_T>::Iterator BufferedMap<Key_T, Mapped_T>::end() {
+    flush();
+    return map.end();
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename BufferedMap<Key_T, Mapped_T>::ConstIterator BufferedMap<Key_T, Mapped_T>::begin() const {
+    flush();
+    return static_cast<const Map<Key_T, Mapped_T>&>(map).begin();
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename BufferedMap<Key_T, Mapped_T>::ConstIterator BufferedMap<Key_T, Mapped_T>::end() const {
+    flush();
+    return static_cast<const Map<Key_T, Mapped_T>&>(map).end();
+  }
+
+  //The net effect of the buffered writes to keyIn (as the delta would hold it once the log
+  //is sorted in), false if there are none. Going back through the log from the newest
+  //write, an erase settles it. Inserts before it (or with none, on top of the delta entry)
+  //only count if they come after an erase, and then the oldest of them sets the value.
+  template <typename Key_T, typename Mapped_T>
+  bool BufferedMap<Key_T, Mapped_T>::pendingFor(const Key_T &keyIn, Op &op, const Mapped_T *&value) const {
+    const Pending *insert = nullptr; //the oldest insert after the last erase
+    for (auto write = log.crbegin(); write != log.crend(); ++write) {
+      if (!(write->entry.first == keyIn))
+	continue;
+      if (write->op == ERASE) {
+	op = (insert == nullptr) ? ERASE : REPLACE;
+	value = (insert == nullptr) ? nullptr : &insert->entry.second;
+	return true;
+      }
+      insert = &*write;
+    }
+    auto found = std::lower_bound(delta.cbegin(), delta.cend(), keyIn,
+				  [](const Pending &pending, const Key_T &key) { return pending.entry.first < key; });
+    if (found == delta.cend() || !(found->entry.first == keyIn)) {
+      if (insert == nullptr)
+	return false;
+      op = INSERT;
+      value = &insert->entry.second;
+      return true;
+    }
+    if (insert != nullptr && found->op == ERASE) {
+      op = REPLACE;
+      value = &insert->entry.second;
+      return true;
+    }
+    op = found->op;
+    value = &found->entry.second;
+    return true;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  bool BufferedMap<Key_T, Mapped_T>::contains(const Key_T &keyIn) const {
+    Op op;
+    const Mapped_T *value;
+    if (!pendingFor(keyIn, op, value))
+      return map.contains(keyIn);
+    return (op != ERASE); //a buffered insert adds the key if the map lacks it
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  const Mapped_T *BufferedMap<Key_T, Mapped_T>::get_if(const Key_T &keyIn) const {
+    const Map<Key_T, Mapped_T> &constMap = map; //a lookup in the non-const map would detach a shared one
+    Op op;
+    const Mapped_T *value;
+    if (!pendingFor(keyIn, op, value))
+      return constMap.get_if(keyIn);
+    switch (op) {
+    case INSERT: {
+      const Mapped_T *existing = constMap.get_if(keyIn);
+      return (existing != nullptr) ? existing : value;
+    }
+    case ERASE:
+      return nullptr;
+    default:
+      return value;
+    }
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  const Mapped_T &BufferedMap<Key_T, Mapped_T>::at(const Key_T &keyIn) const {
+    const Mapped_T *found = get_if(keyIn);
+    if (found == nullptr)
+      throw std::out_of_range("attempted to access a key which is not in the map");
+    return *found;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename BufferedMap<Key_T, Mapped_T>::ConstIterator BufferedMap<Key_T, Mapped_T>::find(const Key_T &keyIn) const {
+    Op op;
+    const Mapped_T *value;
+    if (pendingFor(keyIn, op, value))
+      flush(); //the iterator (or end()) has to be the one the merged map will give
+    return static_cast<const Map<Key_T, Mapped_T>&>(map).find(keyIn);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename BufferedMap<Key_T, Mapped_T>::ConstIterator BufferedMap<Key_T, Mapped_T>::lower_bound(const Key_T &keyIn) const {
+    flush();
+    return static_cast<const Map<Key_T, Mapped_T>&>(map).lower_bound(keyIn);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename BufferedMap<Key_T, Mapped_T>::ConstIterator BufferedMap<Key_T, Mapped_T>::upper_bound(const Key_T &keyIn) const {
+    flush();
+    return static_cast<const Map<Key_T, Mapped_T>&>(map).upper_bound(keyIn);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  void BufferedMap<Key_T, Mapped_T>::insert(const ValueType &valueIn) {
+    add(Pending{std::pair<Key_T, Mapped_T>(valueIn.first, valueIn.second), INSERT});
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  void BufferedMap<Key_T, Mapped_T>::erase(const Key_T &keyIn) {
+    add(Pending{std::pair<Key_T, Mapped_T>(keyIn, Mapped_T()), ERASE});
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  void BufferedMap<Key_T, Mapped_T>::clear() {
+    log.clear();
+    delta.clear();
+    map.clear();
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  void BufferedMap<Key_T, Mapped_T>::add(Pending &&write) {
+    log.push_back(std::move(write));
+    if (log.size() < std::min(capacity, LOG_CAPACITY))
+      return;
+    settle();
+    if (delta.size() >= capacity)
+      flush();
+  }
+
+  //An erase always wins, and an insert after an erase turns into a replace. An insert on
+  //top of an insert or a replace changes nothing, since the key is there by then.
+  template <typename Key_T, typename Mapped_T>
+  void BufferedMap<Key_T, Mapped_T>::fold(Pending &into, const Pending &write) {
+    if (write.op == ERASE)
+      into.op = ERASE;
+    else if (into.op == ERASE) {
+      into.entry.second = write.entry.second;
+      into.op = REPLACE;
+    }
+  }
+
+  //Sorts the log by key (keeping the order of the writes to one key) and merges it into
+  //the delta, folding each key's writes into its delta entry
+  template <typename Key_T, typename Mapped_T>
+  void BufferedMap<Key_T, Mapped_T>::settle() const {
+    if (log.empty())
+      return;
+    std::stable_sort(log.begin(), log.end(),
+		     [](const Pending &lhs, const Pending &rhs) { return lhs.entry.first < rhs.entry.first; });
+    spare.clear();
+    spare.reserve(delta.size() + log.size());
+    auto old = delta.begin();
+    for (auto write = log.begin(); write != log.end(); ) {
+      while (old != delta.end() && old->entry.first < write->entry.first)
+	spare.push_back(std::move(*old++));
+      if (old != delta.end() && old->entry.first == write->entry.first)
+	spare.push_back(std::move(*old++));
+      else
+	spare.push_back(std::move(*write++)); //the first write to a new key starts its entry
+      for (; write != log.end() && write->entry.first == spare.back().entry.first; ++write)
+	fold(spare.back(), *write);
+    }
+    std::move(old, delta.end(), std::back_inserter(spare));
+    delta.swap(spare);
+    log.clear();
+  }
+
+  //Erases the keys of erases and replaces in one sorted pass, then inserts the entries
+  //of inserts and replaces in another. Doing that again changes nothing, so if it throws
+  //the delta is kept and the next flush() finishes the job.
+  template <typename Key_T, typename Mapped_T>
+  void BufferedMap<Key_T, Mapped_T>::flush() const {
+    settle();
+    if (delta.empty())
+      return;
+    std::vector<Key_T> erased;
+    std::vector<std::pair<Key_T, Mapped_T>> inserted;
+    for (const Pending &pending : delta) {
+      if (pending.op != INSERT)
+	erased.push_back(pending.entry.first);
+      if (pending.op != ERASE)
+	inserted.push_back(pending.entry);
+    }
+    map.erase_sorted_batch(erased.begin(), erased.end());
+    map.insert_sorted_batch(inserted.begin(), inserted.end());
+    delta.clear();
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  Map<Key_T, Mapped_T> &BufferedMap<Key_T, Mapped_T>::merged() {
+    flush();
+    return map;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  const Map<Key_T, Mapped_T> &BufferedMap<Key_T, Mapped_T>::merged() const {
+    flush();
+    return map;
+  }
+} //end namespace cs540
+#endif
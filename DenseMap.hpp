@@ -0,0 +1,654 @@
+#ifndef AWILLI64_DENSEMAP_HPP
+#define AWILLI64_DENSEMAP_HPP
+
+#include <new>         //placement new into the slots, std::nothrow_t
+#include <utility>     //std::pair entries
+#include <stdexcept>   //std::out_of_range
+#include <limits>      //default key domain
+#include <type_traits> //std::aligned_storage, std::is_integral, std::is_enum
+#include <cstring>     //memset on the occupancy bitmap
+#include <cstdint>
+#include <initializer_list>
+
+namespace cs540 {
+  //Default key domain of a DenseMap: the whole range of 8 and 16 bit integral keys. Wider
+  //keys and enums have to name their bounds (the empty range below fails a static_assert).
+  template <typename Key_T, bool Narrow = (std::is_integral<Key_T>::value && sizeof(Key_T) <= 2)>
+  struct DenseKeyDomain {
+    static const long long min = 0;
+    static const long long max = -1;
+  };
+
+  template <typename Key_T>
+  struct DenseKeyDomain<Key_T, true> {
+    static const long long min = std::numeric_limits<Key_T>::min();
+    static const long long max = std::numeric_limits<Key_T>::max();
+  };
+
+  //Ordered map for integral (or enum) keys from a small, fixed domain [MinKey, MaxKey]:
+  //every possible key has its own slot in one array, so find()/at() are a bounds check, a
+  //bit test and a load, with no tower to walk. An occupancy bitmap, one bit per slot,
+  //drives ordered iteration by scanning for set bits a word at a time. The slot array
+  //(and the bitmap) are allocated on the first insert and sized for the whole domain.
+  template <typename Key_T, typename Mapped_T,
+	    long long MinKey = DenseKeyDomain<Key_T>::min, long long MaxKey = DenseKeyDomain<Key_T>::max>
+  class DenseMap {
+    static_assert(std::is_integral<Key_T>::value || std::is_enum<Key_T>::value, "DenseMap needs integral or enum keys");
+    static_assert(MinKey <= MaxKey, "DenseMap needs explicit MinKey/MaxKey for enums and keys wider than 16 bits");
+    static_assert(MaxKey - MinKey < (1LL << 24), "DenseMap key domain is too large for direct indexing");
+
+    typedef std::pair<const Key_T, Mapped_T> ValueType;
+  public:
+    class Iterator;
+    class ConstIterator;
+    class ReverseIterator;
+
+    //Constructors and Assignment Operator
+    DenseMap            ();
+    DenseMap            (const DenseMap &);
+    DenseMap            (DenseMap &&);
+    DenseMap            (std::initializer_list<std::pair<const Key_T, Mapped_T>>);
+    DenseMap &operator= (const DenseMap &);
+    DenseMap &operator= (DenseMap &&);
+    ~DenseMap           ();
+    //************************************
+
+    //Size
+    size_t size  () const;
+    bool   empty () const;
+    //************************************
+
+    //Iterators
+    Iterator        begin  ();
+    Iterator        end    ();
+    ConstIterator   begin  () const;
+    ConstIterator   end    () const;
+    ReverseIterator rbegin ();
+    ReverseIterator rend   ();
+    //************************************
+
+    //Element Access
+    Iterator       find        (const Key_T &);
+    ConstIterator  find        (const Key_T &) const;
+    Mapped_T       &at         (const Key_T &);
+    const Mapped_T &at         (const Key_T &) const;
+    Mapped_T       &operator[] (const Key_T &);
+    Iterator       lower_bound (const Key_T &);
+    ConstIterator  lower_bound (const Key_T &) const;
+    Iterator       upper_bound (const Key_T &);
+    ConstIterator  upper_bound (const Key_T &) const;
+    //Lookups that report a missing key instead of throwing: get_if() returns nullptr for it
+    bool           contains    (const Key_T &) const;
+    size_t         count       (const Key_T &) const;
+    Mapped_T       *get_if     (const Key_T &);
+    const Mapped_T *get_if     (const Key_T &) const;
+    //************************************
+
+    //Modifiers
+    //insert() throws std::out_of_range for keys outside [MinKey, MaxKey]
+    std::pair<Iterator, bool> insert (const ValueType &);
+    template <typename IT_T>
+    void                    insert (IT_T range_beg, IT_T range_end);
+    void                    erase  (Iterator pos);
+    void                    erase  (const Key_T &);
+    //returns the number of entries erased (0 or 1) instead of throwing for a missing key
+    size_t                  erase  (const Key_T &, const std::nothrow_t &);
+    void                    clear  ();
+    //************************************
+
+    //Comparison
+    friend bool operator== (const DenseMap &lhs, const DenseMap &rhs) {
+      if (lhs.entryCount != rhs.entryCount)
+	return false;
+      for (auto lhsIt = lhs.begin(), rhsIt = rhs.begin(); lhsIt != lhs.end(); ++lhsIt, ++rhsIt) {
+	if (!(lhsIt->first == rhsIt->first) || !(lhsIt->second == rhsIt->second))
+	  return false;
+      }
+      return true;
+    }
+
+    friend bool operator!= (const DenseMap &lhs, const DenseMap &rhs) {
+      return (!(lhs == rhs));
+    }
+
+    friend bool operator<  (const DenseMap &lhs, const DenseMap &rhs) {
+      auto lhsIt = lhs.begin();
+      auto rhsIt = rhs.begin();
+      while (lhsIt != lhs.end() && rhsIt != rhs.end()) {
+	if ((*lhsIt) < (*rhsIt))
+	  return true;
+	if ((*rhsIt) < (*lhsIt))
+	  return false;
+	++lhsIt;
+	++rhsIt;
+      }
+      return (lhs.entryCount < rhs.entryCount);
+    }
+
+    //Iterators hold a slot index; DOMAIN is the past-the-end (and before-the-begin) position
+    class ConstIterator {
+      friend class DenseMap;
+    public:
+      ConstIterator (const Iterator &inIt) : map(inIt.map), index(inIt.index) {}
+
+      ConstIterator   &operator++ ();
+      ConstIterator   operator++  (int);
+      ConstIterator   &operator-- ();
+      ConstIterator   operator--  (int);
+      const ValueType &operator*  () const;
+      const ValueType *operator-> () const;
+
+      friend bool operator== (const ConstIterator &lhs, const ConstIterator &rhs) {
+	return (lhs.index == rhs.index);
+      }
+
+      friend bool operator!= (const ConstIterator &lhs, const ConstIterator &rhs) {
+	return (lhs.index != rhs.index);
+      }
+
+    private:
+      ConstIterator(const DenseMap *mapIn, size_t indexIn) : map(mapIn), index(indexIn) {}
+
+      const DenseMap *map;
+      size_t index;
+    }; //end class ConstIterator
+
+    class Iterator {
+      friend class DenseMap;
+      friend class ConstIterator;
+    public:
+      Iterator  &operator++ ();
+      Iterator  operator++  (int);
+      Iterator  &operator-- ();
+      Iterator  operator--  (int);
+      ValueType &operator*  () const;
+      ValueType *operator-> () const;
+
+      friend bool operator== (const Iterator &lhs, const Iterator &rhs) {
+	return (lhs.index == rhs.index);
+      }
+
+      friend bool operator!= (const Iterator &lhs, const Iterator &rhs) {
+	return (lhs.index != rhs.index);
+      }
+
+    private:
+      Iterator(DenseMap *mapIn, size_t indexIn) : map(mapIn), index(indexIn) {}
+
+      DenseMap *map;
+      size_t index;
+    }; //end class Iterator
+
+    class ReverseIterator {
+      friend class DenseMap;
+    public:
+      ReverseIterator &operator++ ();
+      ReverseIterator operator++  (int);
+      ReverseIterator &operator-- ();
+      ReverseIterator operator--  (int);
+      ValueType       &operator*  () const;
+      ValueType       *operator-> () const;
+
+      friend bool operator== (const ReverseIterator &lhs, const ReverseIterator &rhs) {
+	return (lhs.index == rhs.index);
+      }
+
+      friend bool operator!= (const ReverseIterator &lhs, const ReverseIterator &rhs) {
+	return (lhs.index != rhs.index);
+      }
+
+    private:
+      ReverseIterator(DenseMap *mapIn, size_t indexIn) : map(mapIn), index(indexIn) {}
+
+      DenseMap *map;
+      size_t index;
+    }; //end class ReverseIterator
+
+  private:
+    static const size_t DOMAIN = MaxKey - MinKey + 1;
+    static const size_t WORDS = (DOMAIN + 63) / 64;
+
+    typedef typename std::aligned_storage<sizeof(ValueType), alignof(ValueType)>::type Slot;
+
+    static bool   inDomain (const Key_T &keyIn);
+    static size_t indexOf  (const Key_T &keyIn);
+
+    bool      occupied  (size_t index) const;
+    ValueType &slotAt   (size_t index) const;
+    size_t    nextIndex (size_t from) const;
+    size_t    prevIndex (size_t before) const;
+    size_t    boundIndex(const Key_T &keyIn, bool inclusive) const;
+    void      allocate  ();
+    void      copyFrom  (const DenseMap &);
+    void      release   ();
+
+    Slot *slots;      //DOMAIN slots, only the occupied ones hold a constructed entry
+    uint64_t *bits;   //occupancy bitmap, WORDS words
+    size_t entryCount;
+  }; //end class DenseMap
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::DenseMap() : slots(nullptr), bits(nullptr), entryCount(0) {}
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::DenseMap(const DenseMap &mapIn) : slots(nullptr), bits(nullptr), entryCount(0) {
+    copyFrom(mapIn);
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::DenseMap(DenseMap &&mapIn) : slots(mapIn.slots), bits(mapIn.bits), entryCount(mapIn.entryCount) {
+    mapIn.slots = nullptr;
+    mapIn.bits = nullptr;
+    mapIn.entryCount = 0;
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::DenseMap(std::initializer_list<std::pair<const Key_T, Mapped_T>> initList) : slots(nullptr), bits(nullptr), entryCount(0) {
+    try {
+      insert(initList.begin(), initList.end());
+    }
+    catch (...) {
+      release();
+      throw;
+    }
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  DenseMap<Key_T, Mapped_T, MinKey, MaxKey> &DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::operator=(const DenseMap &mapIn) {
+    if (&mapIn != this) {
+      DenseMap copy(mapIn);
+      *this = std::move(copy);
+    }
+    return *this;
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  DenseMap<Key_T, Mapped_T, MinKey, MaxKey> &DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::operator=(DenseMap &&mapIn) {
+    if (&mapIn != this) {
+      release();
+      slots = mapIn.slots;
+      bits = mapIn.bits;
+      entryCount = mapIn.entryCount;
+      mapIn.slots = nullptr;
+      mapIn.bits = nullptr;
+      mapIn.entryCount = 0;
+    }
+    return *this;
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::~DenseMap() {
+    release();
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  size_t DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::size() const {
+    return entryCount;
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  bool DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::empty() const {
+    return (entryCount == 0);
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::Iterator DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::begin() {
+    return Iterator(this, nextIndex(0));
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::Iterator DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::end() {
+    return Iterator(this, DOMAIN);
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ConstIterator DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::begin() const {
+    return ConstIterator(this, nextIndex(0));
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ConstIterator DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::end() const {
+    return ConstIterator(this, DOMAIN);
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ReverseIterator DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::rbegin() {
+    return ReverseIterator(this, prevIndex(DOMAIN));
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ReverseIterator DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::rend() {
+    return ReverseIterator(this, DOMAIN);
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::Iterator DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::find(const Key_T &keyIn) {
+    return Iterator(this, (inDomain(keyIn) && occupied(indexOf(keyIn))) ? indexOf(keyIn) : DOMAIN);
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ConstIterator DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::find(const Key_T &keyIn) const {
+    return ConstIterator(this, (inDomain(keyIn) && occupied(indexOf(keyIn))) ? indexOf(keyIn) : DOMAIN);
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  Mapped_T &DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::at(const Key_T &keyIn) {
+    if (!inDomain(keyIn) || !occupied(indexOf(keyIn)))
+      throw std::out_of_range("value not found while using at()");
+    return slotAt(indexOf(keyIn)).second;
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  const Mapped_T &DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::at(const Key_T &keyIn) const {
+    if (!inDomain(keyIn) || !occupied(indexOf(keyIn)))
+      throw std::out_of_range("value not found while using at()");
+    return slotAt(indexOf(keyIn)).second;
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  Mapped_T &DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::operator[](const Key_T &keyIn) {
+    if (inDomain(keyIn) && occupied(indexOf(keyIn)))
+      return slotAt(indexOf(keyIn)).second;
+    Mapped_T newMapped{};
+    return insert(ValueType(keyIn, newMapped)).first->second;
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::Iterator DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::lower_bound(const Key_T &keyIn) {
+    return Iterator(this, boundIndex(keyIn, true));
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ConstIterator DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::lower_bound(const Key_T &keyIn) const {
+    return ConstIterator(this, boundIndex(keyIn, true));
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::Iterator DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::upper_bound(const Key_T &keyIn) {
+    return Iterator(this, boundIndex(keyIn, false));
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ConstIterator DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::upper_bound(const Key_T &keyIn) const {
+    return ConstIterator(this, boundIndex(keyIn, false));
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  bool DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::contains(const Key_T &keyIn) const {
+    return (inDomain(keyIn) && occupied(indexOf(keyIn)));
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  size_t DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::count(const Key_T &keyIn) const {
+    return contains(keyIn) ? 1 : 0;
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  Mapped_T *DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::get_if(const Key_T &keyIn) {
+    return contains(keyIn) ? &slotAt(indexOf(keyIn)).second : nullptr;
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  const Mapped_T *DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::get_if(const Key_T &keyIn) const {
+    return contains(keyIn) ? &slotAt(indexOf(keyIn)).second : nullptr;
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  std::pair<typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::Iterator, bool> DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::insert(const ValueType &valueIn) {
+    if (!inDomain(valueIn.first))
+      throw std::out_of_range("key is outside the domain of this DenseMap");
+    size_t index = indexOf(valueIn.first);
+    if (occupied(index))
+      return std::pair<Iterator, bool>(Iterator(this, index), false);
+    allocate();
+    new (&slots[index]) ValueType(valueIn);
+    bits[index / 64] |= uint64_t(1) << (index % 64);
+    ++entryCount;
+    return std::pair<Iterator, bool>(Iterator(this, index), true);
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  template <typename IT_T>
+  void DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::insert(IT_T range_beg, IT_T range_end) {
+    for (IT_T trav = range_beg; trav != range_end; trav++)
+      insert({(*trav).first, (*trav).second});
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  void DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::erase(Iterator pos) {
+    erase((*pos).first);
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  void DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::erase(const Key_T &keyIn) {
+    if (erase(keyIn, std::nothrow) == 0)
+      throw std::out_of_range("attempted to delete a key which is not in the map");
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  size_t DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::erase(const Key_T &keyIn, const std::nothrow_t &) {
+    if (!contains(keyIn))
+      return 0;
+    size_t index = indexOf(keyIn);
+    slotAt(index).~ValueType();
+    bits[index / 64] &= ~(uint64_t(1) << (index % 64));
+    --entryCount;
+    return 1;
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  void DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::clear() {
+    for (size_t index = nextIndex(0); index != DOMAIN; index = nextIndex(index + 1))
+      slotAt(index).~ValueType();
+    if (bits != nullptr)
+      memset(bits, 0, WORDS * sizeof(uint64_t));
+    entryCount = 0;
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  bool DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::inDomain(const Key_T &keyIn) {
+    return (static_cast<long long>(keyIn) >= MinKey && static_cast<long long>(keyIn) <= MaxKey);
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  size_t DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::indexOf(const Key_T &keyIn) {
+    return static_cast<size_t>(static_cast<long long>(keyIn) - MinKey);
+  }
+
+  //entryCount guards the bitmap, which isn't allocated before the first insert
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  bool DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::occupied(size_t index) const {
+    return (entryCount > 0 && (bits[index / 64] >> (index % 64) & 1));
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ValueType &DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::slotAt(size_t index) const {
+    return *reinterpret_cast<ValueType*>(&slots[index]);
+  }
+
+  //first occupied index >= from, DOMAIN if there is none
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  size_t DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::nextIndex(size_t from) const {
+    if (entryCount == 0 || from >= DOMAIN)
+      return DOMAIN;
+    size_t word = from / 64;
+    uint64_t wordBits = bits[word] & (~uint64_t(0) << (from % 64));
+    while (wordBits == 0) {
+      if (++word == WORDS)
+	return DOMAIN;
+      wordBits = bits[word];
+    }
+    return word * 64 + __builtin_ctzll(wordBits);
+  }
+
+  //last occupied index < before, DOMAIN if there is none
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  size_t DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::prevIndex(size_t before) const {
+    if (entryCount == 0 || before == 0)
+      return DOMAIN;
+    size_t word = (before - 1) / 64;
+    uint64_t wordBits = bits[word] & (~uint64_t(0) >> (63 - (before - 1) % 64));
+    while (wordBits == 0) {
+      if (word == 0)
+	return DOMAIN;
+      wordBits = bits[--word];
+    }
+    return word * 64 + 63 - __builtin_clzll(wordBits);
+  }
+
+  //first occupied index whose key is >= keyIn (inclusive) or > keyIn (!inclusive)
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  size_t DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::boundIndex(const Key_T &keyIn, bool inclusive) const {
+    long long key = static_cast<long long>(keyIn);
+    if (key < MinKey)
+      return nextIndex(0);
+    if (key > MaxKey)
+      return DOMAIN;
+    return nextIndex(indexOf(keyIn) + (inclusive ? 0 : 1));
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  void DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::allocate() {
+    if (slots != nullptr)
+      return;
+    bits = new uint64_t[WORDS]();
+    try {
+      slots = new Slot[DOMAIN];
+    }
+    catch (...) {
+      delete[] bits;
+      bits = nullptr;
+      throw;
+    }
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  void DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::copyFrom(const DenseMap &mapIn) {
+    try {
+      for (auto it = mapIn.begin(); it != mapIn.end(); ++it)
+	insert(*it);
+    }
+    catch (...) {
+      release();
+      throw;
+    }
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  void DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::release() {
+    clear();
+    delete[] slots;
+    delete[] bits;
+    slots = nullptr;
+    bits = nullptr;
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::Iterator &DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::Iterator::operator++() {
+    index = map->nextIndex(index + 1);
+    return *this;
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::Iterator DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::Iterator::operator++(int) {
+    Iterator tmp = *this;
+    ++*this;
+    return tmp;
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::Iterator &DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::Iterator::operator--() {
+    index = map->prevIndex(index);
+    return *this;
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::Iterator DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::Iterator::operator--(int) {
+    Iterator tmp = *this;
+    --*this;
+    return tmp;
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ValueType &DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::Iterator::operator*() const {
+    return map->slotAt(index);
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ValueType *DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::Iterator::operator->() const {
+    return &map->slotAt(index);
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ConstIterator &DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ConstIterator::operator++() {
+    index = map->nextIndex(index + 1);
+    return *this;
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ConstIterator DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ConstIterator::operator++(int) {
+    ConstIterator tmp = *this;
+    ++*this;
+    return tmp;
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ConstIterator &DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ConstIterator::operator--() {
+    index = map->prevIndex(index);
+    return *this;
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ConstIterator DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ConstIterator::operator--(int) {
+    ConstIterator tmp = *this;
+    --*this;
+    return tmp;
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  const typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ValueType &DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ConstIterator::operator*() const {
+    return map->slotAt(index);
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  const typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ValueType *DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ConstIterator::operator->() const {
+    return &map->slotAt(index);
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ReverseIterator &DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ReverseIterator::operator++() {
+    index = map->prevIndex(index == DOMAIN ? 0 : index);
+    return *this;
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ReverseIterator DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ReverseIterator::operator++(int) {
+    ReverseIterator tmp = *this;
+    ++*this;
+    return tmp;
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ReverseIterator &DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ReverseIterator::operator--() {
+    index = map->nextIndex(index == DOMAIN ? 0 : index + 1);
+    return *this;
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ReverseIterator DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ReverseIterator::operator--(int) {
+    ReverseIterator tmp = *this;
+    --*this;
+    return tmp;
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ValueType &DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ReverseIterator::operator*() const {
+    return map->slotAt(index);
+  }
+
+  template <typename Key_T, typename Mapped_T, long long MinKey, long long MaxKey>
+  typename DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ValueType *DenseMap<Key_T, Mapped_T, MinKey, MaxKey>::ReverseIterator::operator->() const {
+    return &map->slotAt(index);
+  }
+} //end namespace cs540
+#endif
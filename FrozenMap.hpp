@@ -0,0 +1,453 @@
+#ifndef AWILLI64_FROZENMAP_HPP
+#define AWILLI64_FROZENMAP_HPP
+
+#include "Map.hpp"
+
+#include <new>         //placement new into the key/value arrays
+#include <utility>     //std::pair for dereferenced iterators
+#include <cstdint>     //uintptr_t for the prefetch address
+
+namespace cs540 {
+  //Read-only interface over a pair of Eytzinger (BFS) ordered arrays: the keys live in one
+  //contiguous array, so a search walks down an implicit binary tree whose first levels
+  //share cache lines, and the mapped values sit in a parallel array at the same positions.
+  //Slot 0 of both arrays is unused so that the children of slot k are 2k and 2k+1.
+  //FrozenMap owns its arrays on the heap, MappedMap points them into a mapped file.
+  template <typename Key_T, typename Mapped_T>
+  class FrozenView {
+  public:
+    class ConstIterator;
+    class ReverseIterator;
+
+    //what iterators dereference to: the key and value live in separate arrays
+    typedef std::pair<const Key_T &, const Mapped_T &> ValueRef;
+
+    //Size
+    size_t size  () const;
+    bool   empty () const;
+    //************************************
+
+    //Iterators
+    ConstIterator   begin  () const;
+    ConstIterator   end    () const;
+    ReverseIterator rbegin () const;
+    ReverseIterator rend   () const;
+    //************************************
+
+    //Element Access
+    ConstIterator  find        (const Key_T &) const;
+    const Mapped_T &at         (const Key_T &) const;
+    ConstIterator  lower_bound (const Key_T &) const;
+    ConstIterator  upper_bound (const Key_T &) const;
+    //************************************
+
+    //Iterators hold an Eytzinger slot; 0 is the past-the-end (and before-the-begin) position
+    class ConstIterator {
+      friend class FrozenView;
+    public:
+      class ArrowProxy {
+      public:
+	ArrowProxy(const ValueRef &refIn) : ref(refIn) {}
+	const ValueRef *operator-> () const { return &ref; }
+      private:
+	ValueRef ref;
+      };
+
+      ConstIterator   &operator++ ();
+      ConstIterator   operator++  (int);
+      ConstIterator   &operator-- ();
+      ConstIterator   operator--  (int);
+      ValueRef        operator*   () const;
+      ArrowProxy      operator->  () const;
+
+      friend bool operator== (const ConstIterator &lhs, const ConstIterator &rhs) {
+	return (lhs.slot == rhs.slot);
+      }
+
+      friend bool operator!= (const ConstIterator &lhs, const ConstIterator &rhs) {
+	return (lhs.slot != rhs.slot);
+      }
+
+    private:
+      ConstIterator(const FrozenView *mapIn, size_t slotIn) : map(mapIn), slot(slotIn) {}
+
+      const FrozenView *map;
+      size_t slot;
+    }; //end class ConstIterator
+
+    class ReverseIterator {
+      friend class FrozenView;
+    public:
+      ReverseIterator                      &operator++ ();
+      ReverseIterator                      operator++  (int);
+      ReverseIterator                      &operator-- ();
+      ReverseIterator                      operator--  (int);
+      ValueRef                             operator*   () const;
+      typename ConstIterator::ArrowProxy   operator->  () const;
+
+      friend bool operator== (const ReverseIterator &lhs, const ReverseIterator &rhs) {
+	return (lhs.slot == rhs.slot);
+      }
+
+      friend bool operator!= (const ReverseIterator &lhs, const ReverseIterator &rhs) {
+	return (lhs.slot != rhs.slot);
+      }
+
+    private:
+      ReverseIterator(const FrozenView *mapIn, size_t slotIn) : map(mapIn), slot(slotIn) {}
+
+      const FrozenView *map;
+      size_t slot;
+    }; //end class ReverseIterator
+
+    //Eytzinger helpers
+    static size_t searchSlot (const Key_T *keysIn, size_t count, const Key_T &keyIn, bool inclusive);
+    static size_t firstSlot  (size_t count);
+    static size_t lastSlot   (size_t count);
+    static size_t nextSlot   (size_t slotIn, size_t count);
+    static size_t prevSlot   (size_t slotIn, size_t count);
+
+  protected:
+    typedef typename std::remove_const<Key_T>::type StoredKey;
+
+    FrozenView() : numKeys(0), keys(nullptr), values(nullptr) {}
+
+    size_t numKeys;
+    const StoredKey *keys;
+    const Mapped_T *values;
+  }; //end class FrozenView
+
+  //Immutable, read-only version of a Map that owns its Eytzinger arrays.
+  template <typename Key_T, typename Mapped_T>
+  class FrozenMap : public FrozenView<Key_T, Mapped_T> {
+  public:
+    //Constructors and Assignment Operator
+    explicit FrozenMap (const Map<Key_T, Mapped_T> &);
+    FrozenMap          (const FrozenMap &);
+    FrozenMap          &operator= (const FrozenMap &);
+    ~FrozenMap         ();
+    //************************************
+
+  private:
+    typedef typename FrozenView<Key_T, Mapped_T>::StoredKey StoredKey;
+    typedef FrozenView<Key_T, Mapped_T> View;
+
+    void copyFrom (const FrozenMap &);
+    void destroy  ();
+  }; //end class FrozenMap
+
+  template <typename Key_T, typename Mapped_T>
+  FrozenMap<Key_T, Mapped_T> freeze(const Map<Key_T, Mapped_T> &mapIn) {
+    return FrozenMap<Key_T, Mapped_T>(mapIn);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  FrozenMap<Key_T, Mapped_T>::FrozenMap(const Map<Key_T, Mapped_T> &mapIn) {
+    size_t count = mapIn.size();
+    StoredKey *newKeys = static_cast<StoredKey*>(::operator new(sizeof(StoredKey) * (count + 1)));
+    Mapped_T *newValues = static_cast<Mapped_T*>(::operator new(sizeof(Mapped_T) * (count + 1)));
+
+    //an in-order walk of the implicit tree visits the slots in key order, so the map's
+    //entries can be dropped into place as they come
+    size_t built = 0;
+    size_t slot = View::firstSlot(count);
+    try {
+      for (auto it = mapIn.begin(); it != mapIn.end(); ++it) {
+	new (&newKeys[slot]) StoredKey(it->first);
+	try {
+	  new (&newValues[slot]) Mapped_T(it->second);
+	}
+	catch (...) {
+	  newKeys[slot].~StoredKey();
+	  throw;
+	}
+	++built;
+	slot = View::nextSlot(slot, count);
+      }
+    }
+    catch (...) {
+      //only the first 'built' slots in key order were constructed
+      slot = View::firstSlot(count);
+      for (size_t i = 0; i < built; ++i, slot = View::nextSlot(slot, count)) {
+	newKeys[slot].~StoredKey();
+	newValues[slot].~Mapped_T();
+      }
+      ::operator delete(newKeys);
+      ::operator delete(newValues);
+      throw;
+    }
+    this->keys = newKeys;
+    this->values = newValues;
+    this->numKeys = count;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  FrozenMap<Key_T, Mapped_T>::FrozenMap(const FrozenMap &mapIn) {
+    copyFrom(mapIn);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  FrozenMap<Key_T, Mapped_T> &FrozenMap<Key_T, Mapped_T>::operator=(const FrozenMap &mapIn) {
+    if (&mapIn != this) {
+      destroy();
+      copyFrom(mapIn);
+    }
+    return *this;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  FrozenMap<Key_T, Mapped_T>::~FrozenMap() {
+    destroy();
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  void FrozenMap<Key_T, Mapped_T>::copyFrom(const FrozenMap &mapIn) {
+    StoredKey *newKeys = static_cast<StoredKey*>(::operator new(sizeof(StoredKey) * (mapIn.numKeys + 1)));
+    Mapped_T *newValues = static_cast<Mapped_T*>(::operator new(sizeof(Mapped_T) * (mapIn.numKeys + 1)));
+    size_t slot = 1;
+    try {
+      for (; slot <= mapIn.numKeys; ++slot) {
+	new (&newKeys[slot]) StoredKey(mapIn.keys[slot]);
+	try {
+	  new (&newValues[slot]) Mapped_T(mapIn.values[slot]);
+	}
+	catch (...) {
+	  newKeys[slot].~StoredKey();
+	  throw;
+	}
+      }
+    }
+    catch (...) {
+      while (--slot > 0) {
+	newKeys[slot].~StoredKey();
+	newValues[slot].~Mapped_T();
+      }
+      ::operator delete(newKeys);
+      ::operator delete(newValues);
+      throw;
+    }
+    this->keys = newKeys;
+    this->values = newValues;
+    this->numKeys = mapIn.numKeys;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  void FrozenMap<Key_T, Mapped_T>::destroy() {
+    for (size_t slot = 1; slot <= this->numKeys; ++slot) {
+      this->keys[slot].~StoredKey();
+      this->values[slot].~Mapped_T();
+    }
+    ::operator delete(const_cast<StoredKey*>(this->keys));
+    ::operator delete(const_cast<Mapped_T*>(this->values));
+    this->keys = nullptr;
+    this->values = nullptr;
+    this->numKeys = 0;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  size_t FrozenView<Key_T, Mapped_T>::size() const {
+    return numKeys;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  bool FrozenView<Key_T, Mapped_T>::empty() const {
+    return (numKeys == 0);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename FrozenView<Key_T, Mapped_T>::ConstIterator FrozenView<Key_T, Mapped_T>::begin() const {
+    return ConstIterator(this, firstSlot(numKeys));
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename FrozenView<Key_T, Mapped_T>::ConstIterator FrozenView<Key_T, Mapped_T>::end() const {
+    return ConstIterator(this, 0);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename FrozenView<Key_T, Mapped_T>::ReverseIterator FrozenView<Key_T, Mapped_T>::rbegin() const {
+    return ReverseIterator(this, lastSlot(numKeys));
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename FrozenView<Key_T, Mapped_T>::ReverseIterator FrozenView<Key_T, Mapped_T>::rend() const {
+    return ReverseIterator(this, 0);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename FrozenView<Key_T, Mapped_T>::ConstIterator FrozenView<Key_T, Mapped_T>::find(const Key_T &keyIn) const {
+    size_t slot = searchSlot(keys, numKeys, keyIn, true);
+    if (slot != 0 && keys[slot] == keyIn)
+      return ConstIterator(this, slot);
+    return end();
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  const Mapped_T &FrozenView<Key_T, Mapped_T>::at(const Key_T &keyIn) const {
+    size_t slot = searchSlot(keys, numKeys, keyIn, true);
+    if (slot == 0 || !(keys[slot] == keyIn))
+      throw std::out_of_range("value not found while using at()");
+    return values[slot];
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename FrozenView<Key_T, Mapped_T>::ConstIterator FrozenView<Key_T, Mapped_T>::lower_bound(const Key_T &keyIn) const {
+    return ConstIterator(this, searchSlot(keys, numKeys, keyIn, true));
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename FrozenView<Key_T, Mapped_T>::ConstIterator FrozenView<Key_T, Mapped_T>::upper_bound(const Key_T &keyIn) const {
+    return ConstIterator(this, searchSlot(keys, numKeys, keyIn, false));
+  }
+
+  //Branchless descent: every level adds one bit (went right or not) to slot, and the only
+  //branch is the loop test, whose trip count is the same for every key. The prefetch pulls
+  //in the line holding the slot's descendants a few levels down while the current compare runs.
+  //Afterwards the trailing 1 bits (plus one) are the right turns taken since the last left
+  //turn; shifting them off lands on the node where the search last went left, which is
+  //the first key >= keyIn (or > keyIn when !inclusive), or 0 if there is none.
+  template <typename Key_T, typename Mapped_T>
+  size_t FrozenView<Key_T, Mapped_T>::searchSlot(const Key_T *keysIn, size_t count, const Key_T &keyIn, bool inclusive) {
+    const size_t PREFETCH_STRIDE = (64 / sizeof(Key_T)) ? (64 / sizeof(Key_T)) : 1;
+    size_t slot = 1;
+    if (inclusive) {
+      while (slot <= count) {
+	__builtin_prefetch(reinterpret_cast<const void*>(reinterpret_cast<uintptr_t>(keysIn) + slot * PREFETCH_STRIDE * sizeof(Key_T)));
+	slot = 2 * slot + (keysIn[slot] < keyIn);
+      }
+    }
+    else {
+      while (slot <= count) {
+	__builtin_prefetch(reinterpret_cast<const void*>(reinterpret_cast<uintptr_t>(keysIn) + slot * PREFETCH_STRIDE * sizeof(Key_T)));
+	slot = 2 * slot + !(keyIn < keysIn[slot]);
+      }
+    }
+    return slot >> __builtin_ffsll(~static_cast<unsigned long long>(slot));
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  size_t FrozenView<Key_T, Mapped_T>::firstSlot(size_t count) {
+    if (count == 0)
+      return 0;
+    size_t slot = 1;
+    while (2 * slot <= count)
+      slot = 2 * slot;
+    return slot;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  size_t FrozenView<Key_T, Mapped_T>::lastSlot(size_t count) {
+    if (count == 0)
+      return 0;
+    size_t slot = 1;
+    while (2 * slot + 1 <= count)
+      slot = 2 * slot + 1;
+    return slot;
+  }
+
+  //in-order successor: leftmost node of the right subtree, or else the first ancestor we
+  //are a left descendant of. Stepping past the last slot gives 0 and from 0 we wrap to the
+  //first slot, so end() can be decremented and rend() incremented like the Map iterators.
+  template <typename Key_T, typename Mapped_T>
+  size_t FrozenView<Key_T, Mapped_T>::nextSlot(size_t slotIn, size_t count) {
+    if (slotIn == 0)
+      return firstSlot(count);
+    if (2 * slotIn + 1 <= count) {
+      slotIn = 2 * slotIn + 1;
+      while (2 * slotIn <= count)
+	slotIn = 2 * slotIn;
+      return slotIn;
+    }
+    while (slotIn & 1)
+      slotIn >>= 1;
+    return slotIn >> 1;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  size_t FrozenView<Key_T, Mapped_T>::prevSlot(size_t slotIn, size_t count) {
+    if (slotIn == 0)
+      return lastSlot(count);
+    if (2 * slotIn <= count) {
+      slotIn = 2 * slotIn;
+      while (2 * slotIn + 1 <= count)
+	slotIn = 2 * slotIn + 1;
+      return slotIn;
+    }
+    while (slotIn > 1 && !(slotIn & 1))
+      slotIn >>= 1;
+    return slotIn >> 1;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename FrozenView<Key_T, Mapped_T>::ConstIterator &FrozenView<Key_T, Mapped_T>::ConstIterator::operator++() {
+    slot = nextSlot(slot, map->numKeys);
+    return *this;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename FrozenView<Key_T, Mapped_T>::ConstIterator FrozenView<Key_T, Mapped_T>::ConstIterator::operator++(int) {
+    auto tmp = *this;
+    slot = nextSlot(slot, map->numKeys);
+    return tmp;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename FrozenView<Key_T, Mapped_T>::ConstIterator &FrozenView<Key_T, Mapped_T>::ConstIterator::operator--() {
+    slot = prevSlot(slot, map->numKeys);
+    return *this;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename FrozenView<Key_T, Mapped_T>::ConstIterator FrozenView<Key_T, Mapped_T>::ConstIterator::operator--(int) {
+    auto tmp = *this;
+    slot = prevSlot(slot, map->numKeys);
+    return tmp;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename FrozenView<Key_T, Mapped_T>::ValueRef FrozenView<Key_T, Mapped_T>::ConstIterator::operator*() const {
+    return ValueRef(map->keys[slot], map->values[slot]);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename FrozenView<Key_T, Mapped_T>::ConstIterator::ArrowProxy FrozenView<Key_T, Mapped_T>::ConstIterator::operator->() const {
+    return ArrowProxy(**this);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename FrozenView<Key_T, Mapped_T>::ReverseIterator &FrozenView<Key_T, Mapped_T>::ReverseIterator::operator++() {
+    slot = prevSlot(slot, map->numKeys);
+    return *this;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename FrozenView<Key_T, Mapped_T>::ReverseIterator FrozenView<Key_T, Mapped_T>::ReverseIterator::operator++(int) {
+    auto tmp = *this;
+    slot = prevSlot(slot, map->numKeys);
+    return tmp;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename FrozenView<Key_T, Mapped_T>::ReverseIterator &FrozenView<Key_T, Mapped_T>::ReverseIterator::operator--() {
+    slot = nextSlot(slot, map->numKeys);
+    return *this;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename FrozenView<Key_T, Mapped_T>::ReverseIterator FrozenView<Key_T, Mapped_T>::ReverseIterator::operator--(int) {
+    auto tmp = *this;
+    slot = nextSlot(slot, map->numKeys);
+    return tmp;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename FrozenView<Key_T, Mapped_T>::ValueRef FrozenView<Key_T, Mapped_T>::ReverseIterator::operator*() const {
+    return ValueRef(map->keys[slot], map->values[slot]);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename FrozenView<Key_T, Mapped_T>::ConstIterator::ArrowProxy FrozenView<Key_T, Mapped_T>::ReverseIterator::operator->() const {
+    return typename ConstIterator::ArrowProxy(**this);
+  }
+} //end namespace cs540
+#endif
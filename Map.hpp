@@ -1,13 +1,216 @@
 #ifndef AWILLI64_MAP_HPP
 #define AWILLI64_MAP_HPP
 
-#include <random>    //to generate random node height in insert()
-#include <stdexcept> //to throw std::out_of_range in at()
+#include <random>      //to generate random node height in insert()
+#include <stdexcept>   //to throw std::out_of_range in at()
+#include <istream>     //save() and load() to/from streams
+#include <ostream>
+#include <cstring>     //memcpy for the buffered snapshot reader/writer
+#include <cstdint>     //fixed width fields in the snapshot header
+#include <cerrno>
+#include <type_traits> //std::is_trivially_copyable for the default serializer
+#include <unistd.h>    //save() and load() to/from file descriptors
+#include <vector>      //snapshot bookkeeping
+#include <utility>
+#include <limits>
+#include <algorithm>   //std::max in merge()
+#include <functional>  //std::hash for the Bloom filter
+#include <thread>      //build() on several threads
+#include <exception>   //std::exception_ptr to hand errors back from worker threads
+#include <system_error>
+#include <new>         //std::nothrow_t for the non-throwing erase()
+#include <mutex>       //the node arena behind compressed links
+#include <sys/mman.h>  //mmap to reserve that arena
+#if defined(__SSE2__)
+#include <immintrin.h> //SIMD compares in the integral key index
+#endif
 
 #pragma GCC diagnostic ignored "-Wunknown-pragmas"     //tells clang to ignore the next pragma
 #pragma GCC diagnostic ignored "-Wnon-template-friend" //ignore spurious warnings about non-templated friend functions
 
 namespace cs540 {
+  //Buffered sink used by Map::save(). Collects writes in a large buffer and hands them
+  //to either a std::ostream or a file descriptor in big chunks.
+  class ByteWriter {
+  public:
+    ByteWriter(std::ostream &osIn) : os(&osIn), fd(-1), used(0), buf(new char[BUFFER_SIZE]) {}
+    ByteWriter(int fdIn) : os(nullptr), fd(fdIn), used(0), buf(new char[BUFFER_SIZE]) {}
+    ~ByteWriter() { delete [] buf; }
+    ByteWriter(const ByteWriter &) = delete;
+    ByteWriter &operator=(const ByteWriter &) = delete;
+
+    void write(const void *src, size_t len) {
+      const char *in = static_cast<const char*>(src);
+      while (len > 0) {
+	if (used == BUFFER_SIZE)
+	  flush();
+	size_t chunk = (len < BUFFER_SIZE - used) ? len : BUFFER_SIZE - used;
+	memcpy(buf + used, in, chunk);
+	used += chunk;
+	in += chunk;
+	len -= chunk;
+      }
+    }
+
+    void flush() {
+      if (os != nullptr) {
+	if (!os->write(buf, used))
+	  throw std::runtime_error("failed to write map snapshot to stream");
+      }
+      else {
+	size_t done = 0;
+	while (done < used) {
+	  ssize_t n = ::write(fd, buf + done, used - done);
+	  if (n < 0 && errno == EINTR)
+	    continue;
+	  if (n <= 0)
+	    throw std::runtime_error("failed to write map snapshot to file descriptor");
+	  done += n;
+	}
+      }
+      used = 0;
+    }
+
+  private:
+    static const size_t BUFFER_SIZE = 1 << 20;
+    std::ostream *os;
+    int fd;
+    size_t used;
+    char *buf;
+  }; //end class ByteWriter
+
+  //Buffered source used by Map::load(). Pulls large chunks from a std::istream or a file
+  //descriptor so that loading is bound by I/O rather than per-record calls.
+  class ByteReader {
+  public:
+    ByteReader(std::istream &isIn) : is(&isIn), fd(-1), pos(0), avail(0), buf(new char[BUFFER_SIZE]) {}
+    ByteReader(int fdIn) : is(nullptr), fd(fdIn), pos(0), avail(0), buf(new char[BUFFER_SIZE]) {}
+    ~ByteReader() { delete [] buf; }
+    ByteReader(const ByteReader &) = delete;
+    ByteReader &operator=(const ByteReader &) = delete;
+
+    void read(void *dst, size_t len) {
+      char *out = static_cast<char*>(dst);
+      while (len > 0) {
+	if (pos == avail)
+	  fill();
+	size_t chunk = (len < avail - pos) ? len : avail - pos;
+	memcpy(out, buf + pos, chunk);
+	pos += chunk;
+	out += chunk;
+	len -= chunk;
+      }
+    }
+
+  private:
+    void fill() {
+      pos = 0;
+      avail = 0;
+      if (is != nullptr) {
+	is->read(buf, BUFFER_SIZE);
+	avail = is->gcount();
+      }
+      else {
+	ssize_t n;
+	do {
+	  n = ::read(fd, buf, BUFFER_SIZE);
+	} while (n < 0 && errno == EINTR);
+	if (n > 0)
+	  avail = n;
+      }
+      if (avail == 0)
+	throw std::runtime_error("unexpected end of map snapshot");
+    }
+
+    static const size_t BUFFER_SIZE = 1 << 20;
+    std::istream *is;
+    int fd;
+    size_t pos;
+    size_t avail;
+    char *buf;
+  }; //end class ByteReader
+
+  //Compile-time options for Map<Key_T, Mapped_T>. To change them for one key/value pair,
+  //specialize MapTraits for it (in namespace cs540) and derive from DefaultMapTraits, e.g.
+  //  template <> struct MapTraits<char, std::string> : DefaultMapTraits {
+  //    static const size_t inlineCapacity = 48;
+  //  };
+  struct DefaultMapTraits {
+    //Up to this many entries (at most 64) are kept in a sorted array inside the Map object
+    //instead of in skip list nodes, with no heap allocation at all. The map turns into a
+    //skip list for good when it grows past that (which invalidates its iterators), or
+    //when a skip-list-only feature such as snapshot() or merge() is used. 0 disables it.
+    static const size_t inlineCapacity = 0;
+
+    //For 4 and 8 byte integral keys, the keys on one of the upper levels of the skip list
+    //are also kept in a contiguous sorted array. find() and lower_bound() search it with
+    //SIMD compares (SSE2/AVX2 where the target has them) to pick the node to drop down
+    //from, which skips the pointer chasing on every level above it. It is kept current by
+    //insert() and erase(), and rebuilt at the end of any other change, so lookups only read
+    //it. Costs one key and one pointer per node on that level, and a little more per write.
+    static const bool keyIndex = false;
+
+    //Every node also keeps a copy of the key that each of its forward links points to, so
+    //a search decides whether to move right or drop down from the node it is already on,
+    //and only the nodes on its path get dereferenced. Costs one key per tower level in
+    //every node, and only applies to trivially copyable keys of at most 16 bytes.
+    static const bool cacheNextKeys = false;
+
+    //Keeps each entry in a separate allocation and only a copy of its key in the skip list
+    //node, so searches and the tower stay on compact nodes however large Mapped_T is.
+    //Dereferencing an iterator (or at() on a hit) costs one extra load.
+    static const bool separateValues = false;
+
+    //false drops the backward link from every node, for maps that are only ever walked
+    //forward: one pointer less per node and one store less per insert and erase.
+    //rbegin(), rend() and Iterator::operator-- then fail to compile.
+    static const bool reverseIteration = true;
+
+    //Keeps a blocked Bloom filter of the keys of a large map, so find(), at(), contains(),
+    //erase() and insert() turn most lookups of a missing key away after reading a single
+    //cache line, without descending the skip list. It is kept current by insert(), and
+    //rebuilt at the end of the change that fills it up, of many erase()s, or of any other
+    //change, so lookups only read it. Costs about 10 bits per key. Needs std::hash<Key_T>.
+    static const bool bloomFilter = false;
+
+    //Keeps an open-addressing hash table from every key of a large map to its node, so
+    //find(), at(), operator[] and contains() take one probe instead of an O(log n) search.
+    //Iteration and the bound/range lookups still use the skip list. insert() and erase()
+    //keep it current, other changes rebuild it before they return, so lookups only read it.
+    //Costs 32 to 64 bytes per key on top of the nodes. Needs std::hash<Key_T>.
+    static const bool hashIndex = false;
+
+    //Number of threads that copying a large map (including the first write to a
+    //copy-on-write copy) and clear() split the work across, 0 for one per core. The
+    //entries' copy constructors and destructors then run on those threads, so by default
+    //they stay on the calling thread.
+    static const unsigned copyThreads = 1;
+
+    //Lets snapshot() be used. Every node then carries the write version that linked it
+    //in and a list of the links overwritten since, 16 bytes per node, and every link
+    //write checks for open snapshots. Without it snapshot() fails to compile.
+    static const bool snapshots = false;
+
+    //Stores every link (and the backward link, and the node an Iterator is on) as a
+    //32-bit number instead of a pointer, which halves the towers and fits twice as many
+    //links in a cache line. The nodes of all maps of the type then come from one address
+    //range of 2^32 units of the node alignment (16 GiB for Map<int, int>), reserved up
+    //front but only backed by memory as it is used. Freed nodes are reused for new ones
+    //and not given back to the system.
+    static const bool compressedLinks = false;
+
+    //Every node also counts how many entries each of its forward links skips, so split()
+    //reads the size of the lower half off its search path in O(log n) instead of counting
+    //the smaller half. Costs one size_t per tower level in every node. insert(), erase()
+    //and every node a copy, load() or set operation appends adjust a count on every level
+    //of the map, and merge(), build() and copies split across threads count them in one
+    //more pass over the result.
+    static const bool spanCounts = false;
+  };
+
+  template <typename Key_T, typename Mapped_T>
+  struct MapTraits : DefaultMapTraits {};
+
   template <typename Key_T, typename Mapped_T>
   class Map {
   
@@ -17,21 +220,76 @@ namespace cs540 {
     class Iterator;
     class ConstIterator;
     class ReverseIterator;
+    class Snapshot;
+    class NodeHandle;
+    struct InsertReturn;
+    typedef NodeHandle   node_type;
+    typedef InsertReturn insert_return_type;
 
   private:
     class SentinelNode;
     class DataNode;
+    class InlineEntries;
+
+    static const size_t INLINE_CAPACITY = MapTraits<typename std::remove_const<Key_T>::type, Mapped_T>::inlineCapacity;
+    static_assert(INLINE_CAPACITY <= 64, "MapTraits::inlineCapacity can be at most 64");
+
+    typedef typename std::remove_const<Key_T>::type PlainKey;
+    static const bool KEY_INDEX = MapTraits<PlainKey, Mapped_T>::keyIndex && std::is_integral<PlainKey>::value &&
+      (sizeof(PlainKey) == 4 || sizeof(PlainKey) == 8);
+    class KeyIndex;
+    static const bool NEXT_KEYS = MapTraits<PlainKey, Mapped_T>::cacheNextKeys &&
+      std::is_trivially_copyable<PlainKey>::value && sizeof(PlainKey) <= 16;
+    static const bool SEPARATE_VALUES = MapTraits<PlainKey, Mapped_T>::separateValues;
+    static const bool LINK_PREV = MapTraits<PlainKey, Mapped_T>::reverseIteration;
+    static const bool KEY_FILTER = MapTraits<PlainKey, Mapped_T>::bloomFilter;
+    class KeyFilter;
+    static const bool HASH_INDEX = MapTraits<PlainKey, Mapped_T>::hashIndex;
+    class HashIndex;
+    static const unsigned COPY_THREADS = MapTraits<PlainKey, Mapped_T>::copyThreads;
+    static const bool SNAPSHOTS = MapTraits<PlainKey, Mapped_T>::snapshots;
+    static const bool COMPRESSED_LINKS = MapTraits<PlainKey, Mapped_T>::compressedLinks;
+    static const bool SPAN_COUNTS = MapTraits<PlainKey, Mapped_T>::spanCounts;
+    //what a tower slot, a backward link and an iterator hold to refer to a node
+    typedef typename std::conditional<COMPRESSED_LINKS, uint32_t, DataNode*>::type Link;
+    template <bool Compressed, typename Unused = void>
+    class NodeStore;
+    typedef NodeStore<COMPRESSED_LINKS> Links;
 
     //MAP METHOD PROTOTYPES
     //Constructors and Assignment Operator
   public:
     Map            (); 
     Map            (const Map &);
+    Map            (Map &&);
     Map &operator= (const Map &);
+    Map &operator= (Map &&);
     Map            (std::initializer_list<std::pair<const Key_T, Mapped_T>>);
     ~Map           ();
     //************************************
 
+    //Copy-on-write
+    //When enabled, copies of this map share its nodes instead of cloning them, and the
+    //first map to be modified (or asked for a non-const iterator/reference) takes its own
+    //clone. Copies inherit the setting. Iterators and references obtained from a map
+    //before it was copied must not be used to modify it afterwards, because the nodes they
+    //point to now belong to the copies as well.
+    void setCopyOnWrite (bool);
+    bool isShared       () const;
+    //************************************
+
+    //Snapshots
+    //A snapshot is a read-only, point-in-time view of the map that stays valid while the
+    //map keeps being modified. Taking one is O(1); afterwards insert/erase keep the links
+    //they overwrite (and the nodes they remove) only for as long as an open snapshot can
+    //still see them, and at()/operator[]/find() swap in a fresh copy of a node before
+    //handing out a writable reference to a value an open snapshot can see. Values written
+    //through Iterators are not versioned. Snapshots must not outlive their map. Needs
+    //MapTraits::snapshots.
+    template <bool Enabled = SNAPSHOTS>
+    Snapshot snapshot ();
+    //************************************
+
     //Size
     size_t size  () const;
     bool   empty () const;
@@ -46,21 +304,116 @@ namespace cs540 {
     ReverseIterator rend   ();
     //************************************
 
+    //Parallel scans
+    //partition() cuts the map into up to k consecutive, non-empty ranges of about the same
+    //size at evenly spaced nodes of an upper level, walking O(k) nodes rather than the map.
+    //k = 0 counts as 1, and an empty map has no ranges.
+    //parallel_for_each() calls f on every entry, and parallel_reduce() folds the entries of
+    //each range with fold(T, entry) starting from identity and combines the results in key
+    //order with combine(T, T). Both run each range on a thread of its own (0 threads for
+    //one per core), and the map must not be modified while they run.
+    std::vector<std::pair<Iterator, Iterator>>           partition (size_t k);
+    std::vector<std::pair<ConstIterator, ConstIterator>> partition (size_t k) const;
+    template <typename F>
+    void parallel_for_each (F f, unsigned threads = 0);
+    template <typename F>
+    void parallel_for_each (F f, unsigned threads = 0) const;
+    template <typename T, typename F, typename C>
+    T    parallel_reduce   (T identity, F fold, C combine, unsigned threads = 0) const;
+    //************************************
+
     //Element Access
     Iterator       find        (const Key_T &);
     ConstIterator  find        (const Key_T &) const;
     Mapped_T       &at         (const Key_T &);
     const Mapped_T &at         (const Key_T &) const;
     Mapped_T       &operator[] (const Key_T &);
+    Iterator       lower_bound (const Key_T &);
+    ConstIterator  lower_bound (const Key_T &) const;
+    Iterator       upper_bound (const Key_T &);
+    ConstIterator  upper_bound (const Key_T &) const;
+    //Lookups that report a missing key instead of throwing: get_if() returns nullptr for it
+    bool           contains    (const Key_T &) const;
+    size_t         count       (const Key_T &) const;
+    Mapped_T       *get_if     (const Key_T &);
+    const Mapped_T *get_if     (const Key_T &) const;
     //************************************
 
     //Modifiers
     std::pair<Iterator, bool> insert (const ValueType &);
     template <typename IT_T>
     void                    insert (IT_T range_beg, IT_T range_end);
+    //Replaces the contents of the map with the entries of [range_beg, range_end), which
+    //needn't be sorted (of a repeated key only the first entry is kept, as with insert()).
+    //Up to the given number of threads (0 for one per core) make the nodes and sort their
+    //share of them, merge the sorted runs and link the levels, instead of n searches on
+    //one core. Needs forward iterators.
+    template <typename IT_T>
+    void                    build  (IT_T range_beg, IT_T range_end, unsigned threads = 0);
+    //Insert (as with insert(), keys already in the map keep their values) or erase a batch
+    //of entries or keys sorted by key, in one pass from left to right: each search starts
+    //from where the one for the previous key ended, so a batch of k costs O(k log(n/k))
+    //rather than O(k log n). An element out of order just restarts the search from the
+    //front. Both return how many entries were inserted or erased.
+    template <typename IT_T>
+    size_t                  insert_sorted_batch (IT_T range_beg, IT_T range_end);
+    template <typename IT_T>
+    size_t                  erase_sorted_batch  (IT_T range_beg, IT_T range_end);
     void                    erase  (Iterator pos);
     void                    erase  (const Key_T &);
+    //returns the number of entries erased (0 or 1) instead of throwing for a missing key
+    size_t                  erase  (const Key_T &, const std::nothrow_t &);
     void                    clear  ();
+    //Moves every entry of the other map whose key is not in this one over by relinking its
+    //node, in one pass over both maps (no allocation or copying). Entries with keys this map
+    //already has stay behind in the other map. The other map must not have open snapshots.
+    void                    merge  (Map &);
+    void                    merge  (Map &&);
+    //split() moves the entries with keys >= the given key into the returned map, and join()
+    //moves all entries of a map whose keys all sort before or all after this map's keys to
+    //this one. Both only relink the boundary of each level, O(log n). So that size() stays
+    //exact, split() then counts the smaller half, O(min of the two sizes), unless
+    //MapTraits::spanCounts lets it read the size off its search path. The map
+    //that gives up nodes must not have open snapshots, and join() relinks in O(size of the
+    //other map) while this one has some. Iterators stay valid, but end() of the split map
+    //becomes end() of the upper half.
+    Map                     split  (const Key_T &);
+    void                    join   (Map &&);
+    //************************************
+
+    //Node handles
+    //extract() unlinks an entry and hands over its node, and insert(NodeHandle &&) links
+    //such a node into a map (this one or another), so entries move between maps without
+    //allocating or copying. The key can be changed through the handle in between. If
+    //the key is already present the node stays in the returned handle. Nodes that open
+    //snapshots can still see are copied out instead.
+    NodeHandle   extract (const Key_T &);
+    NodeHandle   extract (Iterator pos);
+    InsertReturn insert  (NodeHandle &&);
+    //************************************
+
+    //Set operations, each building a new map in one pass over both maps
+    //(entries whose key is in both maps take the first map's value)
+    template <typename K, typename M> friend Map<K, M> set_union        (const Map<K, M> &, const Map<K, M> &);
+    template <typename K, typename M> friend Map<K, M> set_intersection (const Map<K, M> &, const Map<K, M> &);
+    template <typename K, typename M> friend Map<K, M> set_difference   (const Map<K, M> &, const Map<K, M> &);
+    //************************************
+
+    //Serialization
+    //Snapshots hold the entries in key order, optionally with each node's tower height so
+    //that load() recreates the exact same shape. The default serializer copies the raw bytes
+    //of trivially copyable keys and values; any other type needs a custom Serializer with
+    //  void write(ByteWriter &, const ValueType &) const;
+    //  ValueType read(ByteReader &) const;
+    class TrivialSerializer;
+    template <typename Serializer = TrivialSerializer>
+    void save (std::ostream &, bool withHeights = false, const Serializer & = Serializer()) const;
+    template <typename Serializer = TrivialSerializer>
+    void save (int fd, bool withHeights = false, const Serializer & = Serializer()) const;
+    template <typename Serializer = TrivialSerializer>
+    void load (std::istream &, const Serializer & = Serializer());
+    template <typename Serializer = TrivialSerializer>
+    void load (int fd, const Serializer & = Serializer());
     //************************************
 
     void print() const;
@@ -69,8 +422,10 @@ namespace cs540 {
 
     //Comparison
     friend bool operator== (const Map &lhs, const Map &rhs) {
-      if (lhs.numNodes != rhs.numNodes)
+      if (lhs.size() != rhs.size())
 	return false;
+      if (lhs.head == rhs.head && lhs.head != nullptr) //copy-on-write copies sharing their nodes
+	return true;
       
       auto lhsIt = lhs.begin();
       auto rhsIt = rhs.begin();
@@ -97,7 +452,7 @@ namespace cs540 {
 	lhsIt++;
 	rhsIt++;
       }
-      if (lhs.numNodes < rhs.numNodes)
+      if (lhs.size() < rhs.size())
 	return true;
       return false;
     }
@@ -107,10 +462,11 @@ namespace cs540 {
       friend bool operator== (const ConstIterator &, const Iterator &);
       friend bool operator!= (const Iterator &, const ConstIterator &);
       friend bool operator!= (const ConstIterator &, const Iterator &);
+      friend class Map;
     public:
-      ConstIterator (DataNode *nodeIn) : cur (nodeIn) {}
+      ConstIterator (DataNode *nodeIn) : cur (Links::encode(nodeIn)), entries(nullptr), slot(0) {}
    
-      ConstIterator (const Iterator &inIt) : cur (inIt.cur) {}
+      ConstIterator (const Iterator &inIt) : cur (inIt.cur), entries(inIt.entries), slot(inIt.slot) {}
 
       ConstIterator   &operator++ ();
       ConstIterator   operator++  (int);
@@ -120,22 +476,29 @@ namespace cs540 {
       const ValueType *operator-> () const;
 
       friend bool operator== (const ConstIterator &lhs, const ConstIterator &rhs) {
-	return (lhs.cur == rhs.cur);
+	return (lhs.cur == rhs.cur && lhs.slot == rhs.slot);
       }
 
       friend bool operator!= (const ConstIterator &lhs, const ConstIterator &rhs) {
-	return (lhs.cur != rhs.cur);
+	return !(lhs == rhs);
       }
 
     private:
-      DataNode *cur;
+      ConstIterator (InlineEntries *entriesIn, int slotIn) : cur(), entries(entriesIn), slot(slotIn) {}
+
+      DataNode *node () const { return Links::decode(cur); }
+
+      Link cur;
+      InlineEntries *entries; //set (and cur null) while the map keeps its entries inline
+      int slot;
     }; //end class ConstIterator
     
     class Iterator {
       friend ConstIterator::ConstIterator(const Iterator &);
+      friend class Map;
      
     public:
-      Iterator(DataNode *nodeIn) : cur(nodeIn) {}
+      Iterator(DataNode *nodeIn) : cur(Links::encode(nodeIn)), entries(nullptr), slot(0) {}
 
       Iterator  &operator++ ();
       Iterator  operator++  (int);
@@ -145,36 +508,43 @@ namespace cs540 {
       ValueType *operator-> () const;
 
       friend bool operator== (const Iterator &lhs, const Iterator &rhs) {
-	return (lhs.cur == rhs.cur);
+	return (lhs.cur == rhs.cur && lhs.slot == rhs.slot);
       }
 
       friend bool operator== (const Iterator &lhs, const ConstIterator &rhs) {
-	return (lhs.cur == rhs.cur);
+	return (lhs.cur == rhs.cur && lhs.slot == rhs.slot);
       }
 
       friend bool operator== (const ConstIterator &lhs, const Iterator &rhs) {
-	return (lhs.cur == rhs.cur);
+	return (lhs.cur == rhs.cur && lhs.slot == rhs.slot);
       }
 
       friend bool operator!= (const Iterator &lhs, const Iterator &rhs) {
-	return (lhs.cur != rhs.cur);
+	return !(lhs == rhs);
       }
 
       friend bool operator!= (const Iterator &lhs, const ConstIterator &rhs) {
-	return (lhs.cur != rhs.cur);
+	return !(lhs == rhs);
       }
 
       friend bool operator!= (const ConstIterator &lhs, const Iterator &rhs) {
-	return (lhs.cur != rhs.cur);
+	return !(lhs == rhs);
       }
          
     private:
-      DataNode *cur;
+      Iterator(InlineEntries *entriesIn, int slotIn) : cur(), entries(entriesIn), slot(slotIn) {}
+
+      DataNode *node () const { return Links::decode(cur); }
+
+      Link cur;
+      InlineEntries *entries;
+      int slot;
     }; //end class Iterator
 
     class ReverseIterator {
+      friend class Map;
     public:
-      ReverseIterator(DataNode *nodeIn) : cur(nodeIn) {}
+      ReverseIterator(DataNode *nodeIn) : cur(Links::encode(nodeIn)), entries(nullptr), slot(0) {}
  
       ReverseIterator &operator++ ();
       ReverseIterator operator++  (int);
@@ -184,110 +554,1025 @@ namespace cs540 {
       ValueType       *operator-> () const;
 
       friend bool operator== (const ReverseIterator &op1, const ReverseIterator &op2) {
-	return (op1.cur == op2.cur);
+	return (op1.cur == op2.cur && op1.slot == op2.slot);
       }
 
       friend bool operator!= (const ReverseIterator &op1, const ReverseIterator &op2) {
-	return (op1.cur != op2.cur);
+	return !(op1 == op2);
       }
 
     private:
-      DataNode *cur;
+      ReverseIterator(InlineEntries *entriesIn, int slotIn) : cur(), entries(entriesIn), slot(slotIn) {}
+
+      DataNode *node () const { return Links::decode(cur); }
+
+      Link cur;
+      InlineEntries *entries;
+      int slot;
     }; //end class ReverseIterator
 
+    class Snapshot {
+      friend class Map;
+    public:
+      class ConstIterator;
+
+      Snapshot  (const Snapshot &);
+      Snapshot  &operator= (const Snapshot &);
+      ~Snapshot ();
+
+      size_t          size  () const;
+      bool            empty () const;
+      ConstIterator   begin () const;
+      ConstIterator   end   () const;
+      ConstIterator   find  (const Key_T &) const;
+      const Mapped_T  &at   (const Key_T &) const;
+
+      //forward only, the prev links are not versioned
+      class ConstIterator {
+	friend class Snapshot;
+      public:
+	ConstIterator   &operator++ ();
+	ConstIterator   operator++  (int);
+	const ValueType &operator*  () const;
+	const ValueType *operator-> () const;
+
+	friend bool operator== (const ConstIterator &lhs, const ConstIterator &rhs) {
+	  return (lhs.cur == rhs.cur);
+	}
+
+	friend bool operator!= (const ConstIterator &lhs, const ConstIterator &rhs) {
+	  return (lhs.cur != rhs.cur);
+	}
+
+      private:
+	ConstIterator(DataNode *nodeIn, uint64_t versionIn) : cur(nodeIn), version(versionIn) {}
+
+	DataNode *cur;
+	uint64_t version;
+      }; //end class ConstIterator
+
+    private:
+      Snapshot(Map *mapIn, uint64_t versionIn);
+
+      Map *map;
+      uint64_t version;
+      size_t numNodes;
+      int height;
+    }; //end class Snapshot
+
+    class NodeHandle {
+      friend class Map;
+    public:
+      NodeHandle  () : node(nullptr) {}
+      NodeHandle  (NodeHandle &&handleIn) : node(handleIn.node) { handleIn.node = nullptr; }
+      NodeHandle  &operator= (NodeHandle &&);
+      NodeHandle  (const NodeHandle &) = delete;
+      NodeHandle  &operator= (const NodeHandle &) = delete;
+      ~NodeHandle () { freeNode(node); }
+
+      bool          empty    () const { return (node == nullptr); }
+      explicit      operator bool () const { return (node != nullptr); }
+      Key_T         &key     () const { return const_cast<Key_T&>(node->value.first); }
+      Mapped_T      &mapped  () const { return node->value.second; }
+
+    private:
+      explicit NodeHandle(DataNode *nodeIn) : node(nodeIn) {}
+
+      DataNode *node;
+    }; //end class NodeHandle
+
+    struct InsertReturn {
+      Iterator   position;
+      bool       inserted;
+      NodeHandle node;
+    };
+
+    class TrivialSerializer {
+    public:
+      void write(ByteWriter &out, const ValueType &valueIn) const {
+	static_assert(std::is_trivially_copyable<Key_T>::value && std::is_trivially_copyable<Mapped_T>::value,
+		      "the default map serializer needs trivially copyable keys and values");
+	out.write(&valueIn.first, sizeof(Key_T));
+	out.write(&valueIn.second, sizeof(Mapped_T));
+      }
+
+      ValueType read(ByteReader &in) const {
+	static_assert(std::is_trivially_copyable<Key_T>::value && std::is_trivially_copyable<Mapped_T>::value,
+		      "the default map serializer needs trivially copyable keys and values");
+	typename std::aligned_storage<sizeof(Key_T), alignof(Key_T)>::type keyBuf;
+	typename std::aligned_storage<sizeof(Mapped_T), alignof(Mapped_T)>::type mappedBuf;
+	in.read(&keyBuf, sizeof(Key_T));
+	in.read(&mappedBuf, sizeof(Mapped_T));
+	return ValueType(*reinterpret_cast<const Key_T*>(&keyBuf), *reinterpret_cast<const Mapped_T*>(&mappedBuf));
+      }
+    }; //end class TrivialSerializer
+
   private:
     static const int MAX_LEVELS = 32;
 
+    //The entries of a map that is still small. Each one stays in the slot it was
+    //constructed in (so iterators survive inserts and erases), order[] lists the used
+    //slots in key order and rank[] is its inverse.
+    class InlineEntries {
+    public:
+      static const int NONE = -1; //slot of end() and rend()
+
+      InlineEntries  () : count(0), used(0) {}
+      InlineEntries  (const InlineEntries &) = delete;
+      InlineEntries  &operator= (const InlineEntries &) = delete;
+      ~InlineEntries () { clear(); }
+
+      ValueType       &value (int slot)       { return *reinterpret_cast<ValueType*>(&slots[slot]); }
+      const ValueType &value (int slot) const { return *reinterpret_cast<const ValueType*>(&slots[slot]); }
+
+      int first () const { return (count > 0) ? order[0] : NONE; }
+      int last  () const { return (count > 0) ? order[count - 1] : NONE; }
+      int next  (int slot) const { return atRank(rank[slot] + 1u); }
+      int prev  (int slot) const { return (rank[slot] > 0) ? order[rank[slot] - 1] : NONE; }
+      int atRank(size_t r) const { return (r < count && r < SLOTS) ? order[r] : NONE; }
+
+      //rank of the first key >= keyIn (inclusive) or > keyIn (!inclusive), by binary search
+      size_t bound(const Key_T &keyIn, bool inclusive) const {
+	size_t lo = 0;
+	size_t hi = count;
+	while (lo < hi) {
+	  size_t mid = (lo + hi) / 2;
+	  const Key_T &midKey = value(order[mid]).first;
+	  if (inclusive ? midKey < keyIn : !(keyIn < midKey))
+	    lo = mid + 1;
+	  else
+	    hi = mid;
+	}
+	return lo;
+      }
+
+      int find(const Key_T &keyIn) const {
+	int slot = atRank(bound(keyIn, true));
+	return (slot != NONE && value(slot).first == keyIn) ? slot : NONE;
+      }
+
+      //constructs the entry in a free slot and puts it at rank r (count < INLINE_CAPACITY)
+      template <typename V>
+      int insertAt(size_t r, V &&valueIn) {
+	int slot = __builtin_ctzll(~used);
+	new (&slots[slot]) ValueType(std::forward<V>(valueIn));
+	used |= uint64_t(1) << slot;
+	for (size_t i = count; i > r; --i) {
+	  order[i] = order[i - 1];
+	  rank[order[i]] = i;
+	}
+	order[r] = slot;
+	rank[slot] = r;
+	++count;
+	return slot;
+      }
+
+      void erase(int slot) {
+	value(slot).~ValueType();
+	used &= ~(uint64_t(1) << slot);
+	--count;
+	memmove(&order[rank[slot]], &order[rank[slot] + 1], count - rank[slot]);
+	for (size_t i = rank[slot]; i < count; ++i)
+	  rank[order[i]] = i;
+      }
+
+      void clear() {
+	for (size_t i = 0; i < count; ++i)
+	  value(order[i]).~ValueType();
+	count = 0;
+	used = 0;
+      }
+
+      void copyFrom(const InlineEntries &src) {
+	for (int slot = src.first(); slot != NONE; slot = src.next(slot))
+	  insertAt(count, src.value(slot));
+      }
+
+      void moveFrom(InlineEntries &src) {
+	for (int slot = src.first(); slot != NONE; slot = src.next(slot))
+	  insertAt(count, std::move(src.value(slot)));
+	src.clear();
+      }
+
+      size_t count;
+
+    private:
+      static const size_t SLOTS = (INLINE_CAPACITY > 0) ? INLINE_CAPACITY : 1;
+
+      uint64_t used; //bitmap of constructed slots
+      uint8_t order[SLOTS];
+      uint8_t rank[SLOTS];
+      typename std::aligned_storage<sizeof(ValueType), alignof(ValueType)>::type slots[SLOTS];
+    }; //end class InlineEntries
+
+    //Sorted copy of the keys (and nodes) on level INDEX_LEVEL, for integral keys. The keys
+    //are stored as signed integers of the same width, unsigned ones with their top bit
+    //flipped, so a single signed compare orders both. BLOCK padding keys follow the real
+    //ones, so the SIMD scan at the end of a search never reads past the array.
+    class KeyIndex {
+    public:
+      typedef typename std::conditional<sizeof(PlainKey) == 8, int64_t, int32_t>::type Stored;
+      static const size_t BLOCK = 16; //keys compared by the final scan
+
+      KeyIndex() : stale(true), builtFor(nullptr) {}
+
+      static Stored toStored(const Key_T &keyIn) {
+	return toStored<PlainKey>(keyIn, std::integral_constant<bool, KEY_INDEX>());
+      }
+
+      //number of indexed keys < key (inclusive) or <= key (!inclusive)
+      size_t rank(Stored key, bool inclusive) const {
+	size_t lo = 0;
+	size_t hi = nodes.size();
+	while (hi - lo > BLOCK) {
+	  size_t mid = lo + (hi - lo) / 2;
+	  if (inclusive ? keys[mid] < key : !(key < keys[mid]))
+	    lo = mid + 1;
+	  else
+	    hi = mid;
+	}
+	return lo + std::min(countBelow(&keys[lo], key, inclusive), hi - lo);
+      }
+
+      void insert(DataNode *node) {
+	Stored key = toStored(node->key());
+	size_t pos = rank(key, true);
+	keys.insert(keys.begin() + pos, key);
+	nodes.insert(nodes.begin() + pos, node);
+      }
+
+      void erase(DataNode *node) {
+	size_t pos = rank(toStored(node->key()), true);
+	keys.erase(keys.begin() + pos);
+	nodes.erase(nodes.begin() + pos);
+      }
+
+      void clear() {
+	keys.assign(BLOCK, std::numeric_limits<Stored>::max());
+	nodes.clear();
+      }
+
+      bool stale;                  //a link on INDEX_LEVEL changed since the index was built
+      const SentinelNode *builtFor; //head of the list it was built from
+      std::vector<Stored> keys;
+      std::vector<DataNode*> nodes;
+
+    private:
+      //templates, so explicit instantiations of Map with other key types don't compile them
+      template <typename K>
+      static Stored toStored(const K &keyIn, std::true_type) {
+	typedef typename std::make_unsigned<Stored>::type Bits;
+	if (std::is_signed<K>::value)
+	  return static_cast<Stored>(keyIn);
+	return static_cast<Stored>(static_cast<Bits>(keyIn) ^ (Bits(1) << (8 * sizeof(Bits) - 1)));
+      }
+
+      template <typename K>
+      static Stored toStored(const K &, std::false_type) {
+	return 0;
+      }
+
+      //counts the keys of block[0, BLOCK) that are < key (inclusive) or <= key (!inclusive)
+      static size_t countBelow(const int32_t *block, int32_t key, bool inclusive) {
+	size_t above = 0;
+#if defined(__AVX2__)
+	__m256i k = _mm256_set1_epi32(key);
+	for (size_t i = 0; i < BLOCK; i += 8) {
+	  __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + i));
+	  __m256i gt = inclusive ? _mm256_cmpgt_epi32(k, v) : _mm256_cmpgt_epi32(v, k);
+	  above += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(gt)));
+	}
+#elif defined(__SSE2__)
+	__m128i k = _mm_set1_epi32(key);
+	for (size_t i = 0; i < BLOCK; i += 4) {
+	  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + i));
+	  __m128i gt = inclusive ? _mm_cmpgt_epi32(k, v) : _mm_cmpgt_epi32(v, k);
+	  above += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(gt)));
+	}
+#else
+	for (size_t i = 0; i < BLOCK; ++i)
+	  above += inclusive ? (block[i] < key) : (key < block[i]);
+#endif
+	return inclusive ? above : BLOCK - above;
+      }
+
+      static size_t countBelow(const int64_t *block, int64_t key, bool inclusive) {
+	size_t above = 0;
+#if defined(__AVX2__)
+	__m256i k = _mm256_set1_epi64x(key);
+	for (size_t i = 0; i < BLOCK; i += 4) {
+	  __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + i));
+	  __m256i gt = inclusive ? _mm256_cmpgt_epi64(k, v) : _mm256_cmpgt_epi64(v, k);
+	  above += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(gt)));
+	}
+#elif defined(__SSE4_2__)
+	__m128i k = _mm_set1_epi64x(key);
+	for (size_t i = 0; i < BLOCK; i += 2) {
+	  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + i));
+	  __m128i gt = inclusive ? _mm_cmpgt_epi64(k, v) : _mm_cmpgt_epi64(v, k);
+	  above += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(gt)));
+	}
+#else
+	for (size_t i = 0; i < BLOCK; ++i)
+	  above += inclusive ? (block[i] < key) : (key < block[i]);
+#endif
+	return inclusive ? above : BLOCK - above;
+      }
+    }; //end class KeyIndex
+
+    //hash of a key for the Bloom filter and the hash index
+    static uint64_t hashKey(const Key_T &keyIn) {
+      return hashKey<PlainKey>(keyIn, std::integral_constant<bool, KEY_FILTER || HASH_INDEX>());
+    }
+
+    //templates, so explicit instantiations of Map with unhashable key types don't compile them
+    template <typename K>
+    static uint64_t hashKey(const K &keyIn, std::true_type) {
+      uint64_t h = std::hash<K>()(keyIn); //mixed, since integers usually hash to themselves
+      h ^= h >> 33;
+      h *= 0xff51afd7ed558ccdULL;
+      h ^= h >> 33;
+      h *= 0xc4ceb9fe1a85ec53ULL;
+      return h ^ (h >> 33);
+    }
+
+    template <typename K>
+    static uint64_t hashKey(const K &, std::false_type) {
+      return 0;
+    }
+
+    //Blocked Bloom filter over the keys of the map. A key's hash picks one 512-bit block
+    //(a cache line) and PROBES bits within it, so testing a key reads a single line. Keys
+    //can't be taken out, erase() only counts them until the filter is worth rebuilding.
+    class KeyFilter {
+    public:
+      static const size_t BLOCK_WORDS = 8;
+      static const int PROBES = 4;           //9 hash bits each, the block index comes from bits 36 and up
+      static const size_t BITS_PER_KEY = 10;
+
+      KeyFilter() : stale(true), builtFor(nullptr), capacity(0), added(0), removed(0), mask(0) {}
+
+      //empties the filter and sizes it for capacityIn keys
+      void reset(size_t capacityIn) {
+	size_t blocks = 1;
+	while (blocks * BLOCK_WORDS * 64 < capacityIn * BITS_PER_KEY && blocks < (size_t(1) << 28))
+	  blocks *= 2;
+	words.assign(blocks * BLOCK_WORDS, 0);
+	mask = blocks - 1;
+	capacity = capacityIn;
+	added = 0;
+	removed = 0;
+      }
+
+      void add(uint64_t h) {
+	uint64_t *block = &words[((h >> 36) & mask) * BLOCK_WORDS];
+	for (int i = 0; i < PROBES; ++i) {
+	  unsigned bit = (h >> (9 * i)) & 511;
+	  block[bit / 64] |= uint64_t(1) << (bit % 64);
+	}
+	if (++added > capacity) //too full for its false positive rate
+	  stale = true;
+      }
+
+      void remove() {
+	if (++removed * 2 > added) //more than half of the keys it holds are gone
+	  stale = true;
+      }
+
+      bool mayContain(uint64_t h) const {
+	const uint64_t *block = &words[((h >> 36) & mask) * BLOCK_WORDS];
+	for (int i = 0; i < PROBES; ++i) {
+	  unsigned bit = (h >> (9 * i)) & 511;
+	  if (!(block[bit / 64] >> (bit % 64) & 1))
+	    return false;
+	}
+	return true;
+      }
+
+      bool stale;                   //keys were added to the map without going through add()
+      const SentinelNode *builtFor; //head of the list it was built from
+
+    private:
+      std::vector<uint64_t> words;
+      size_t capacity;
+      size_t added;
+      size_t removed;
+      size_t mask;                  //number of blocks - 1
+    }; //end class KeyFilter
+
+    //Open-addressing table of the nodes of the map by key hash, with linear probing. It is
+    //kept at most half full, and erase() shifts the entries after the erased one back
+    //instead of leaving tombstones, so a probe sequence always ends at the first empty slot.
+    class HashIndex {
+    public:
+      HashIndex() : stale(true), builtFor(nullptr), count(0), mask(0) {}
+
+      //empties the table and sizes it for expected nodes
+      void reset(size_t expected) {
+	size_t capacity = 16;
+	while (capacity < 2 * expected)
+	  capacity *= 2;
+	slots.assign(capacity, Slot());
+	mask = capacity - 1;
+	count = 0;
+      }
+
+      DataNode *find(uint64_t h, const Key_T &keyIn) const {
+	for (size_t i = h & mask; slots[i].node != nullptr; i = (i + 1) & mask) {
+	  if (slots[i].hash == h && slots[i].node->key() == keyIn)
+	    return slots[i].node;
+	}
+	return nullptr;
+      }
+
+      void insert(uint64_t h, DataNode *node) {
+	if (2 * (count + 1) > slots.size())
+	  grow();
+	place(h, node);
+	++count;
+      }
+
+      void erase(uint64_t h, DataNode *node) {
+	size_t hole = slotOf(h, node);
+	for (size_t i = (hole + 1) & mask; slots[i].node != nullptr; i = (i + 1) & mask) {
+	  //an entry can move into the hole unless its home slot lies after the hole
+	  size_t home = slots[i].hash & mask;
+	  if (((i - home) & mask) >= ((i - hole) & mask)) {
+	    slots[hole] = slots[i];
+	    hole = i;
+	  }
+	}
+	slots[hole] = Slot();
+	--count;
+      }
+
+      //node was swapped for copy (same key) by privateNode()
+      void replace(uint64_t h, DataNode *node, DataNode *copy) {
+	slots[slotOf(h, node)].node = copy;
+      }
+
+      bool stale;                   //nodes came or went without going through insert()/erase()
+      const SentinelNode *builtFor; //head of the list it was built from
+
+    private:
+      struct Slot {
+	Slot() : hash(0), node(nullptr) {}
+	uint64_t hash;
+	DataNode *node;             //nullptr for an empty slot
+      };
+
+      void place(uint64_t h, DataNode *node) {
+	size_t i = h & mask;
+	while (slots[i].node != nullptr)
+	  i = (i + 1) & mask;
+	slots[i].hash = h;
+	slots[i].node = node;
+      }
+
+      size_t slotOf(uint64_t h, const DataNode *node) const {
+	size_t i = h & mask;
+	while (slots[i].node != node)
+	  i = (i + 1) & mask;
+	return i;
+      }
+
+      void grow() {
+	std::vector<Slot> old(2 * slots.size());
+	old.swap(slots);
+	mask = slots.size() - 1;
+	for (size_t i = 0; i < old.size(); ++i) {
+	  if (old[i].node != nullptr)
+	    place(old[i].hash, old[i].node);
+	}
+      }
+
+      std::vector<Slot> slots;
+      size_t count;
+      size_t mask;                  //number of slots - 1
+    }; //end class HashIndex
+
+    //level whose nodes the key index holds (about one node in 2^INDEX_LEVEL), and the
+    //height from which a map is worth indexing
+    static const int INDEX_LEVEL = 7;
+    static const int INDEX_MIN_HEIGHT = INDEX_LEVEL + 4;
+    //height from which a map gets a Bloom filter (about a thousand keys)
+    static const int FILTER_MIN_HEIGHT = 10;
+    //height from which a map gets a hash index (a few hundred keys)
+    static const int HASH_MIN_HEIGHT = 8;
+    //size from which copies and clear() split the work across threads, unless
+    //MapTraits::copyThreads keeps them on one
+    static const size_t PARALLEL_MIN_SIZE = 100000;
+
+    //snapshot format written by save()
+    static const uint32_t SNAPSHOT_MAGIC   = 0x4d303435; //"540M"
+    static const uint32_t SNAPSHOT_VERSION = 1;
+    static const uint32_t SNAPSHOT_HEIGHTS = 1;          //flag: every record starts with a tower height byte
+
     SentinelNode *head;
     SentinelNode *tail;
 
+    bool small;             //entries are inline (head and tail are null) instead of in nodes
+    InlineEntries entries;
     size_t numNodes;
     int height;
 
+    bool copyOnWrite;
+    mutable size_t *shareCount; //number of maps sharing head/tail and the nodes, nullptr while exclusive
+    KeyIndex *keyIndex; //allocated once the map is tall enough to use it
+    KeyFilter *keyFilter; //allocated once the map is tall enough to use it
+    HashIndex *hashIndex; //allocated once the map is tall enough to use it
+
+    //an overwritten link that an open snapshot may still follow
+    struct LinkHistory {
+      DataNode *next;      //what the link pointed to before
+      uint64_t until;      //write version that overwrote it
+      int level;
+      LinkHistory *older;
+    };
+
+    //bookkeeping for snapshot(), allocated by the first one
+    struct VersionLog {
+      VersionLog() : writeVersion(1) {}
+      uint64_t writeVersion;                                //stamp of the changes being made now
+      std::vector<std::pair<uint64_t, size_t>> open;        //open snapshot versions (ascending) and their handle counts
+      std::vector<std::pair<DataNode*, uint64_t>> retired;  //erased nodes and the version that erased them
+      std::vector<SentinelNode*> withHistory;               //nodes with a non-empty history
+    };
+    VersionLog *versions;
+
     //for randomly generating insert height
-    std::random_device r;
     std::default_random_engine e;
     //************************************
 
-    class SentinelNode {
+    bool        isSmall      () const { return (INLINE_CAPACITY > 0 && small); }
+    void        newSentinels ();
+    void        startEmpty   ();
+    void        promote      ();
+    void        copyEntries  (const InlineEntries &);
+    static unsigned newSeed  ();
+    void        copyNodes    (const SentinelNode *srcHead, const SentinelNode *srcTail, size_t count);
+    void        share        (const Map &);
+    void        detach       ();
+    void        release      ();
+    int         randomHeight ();
+    static int  randomHeight (std::default_random_engine &);
+    template <typename F>
+    static void runChunks    (size_t chunks, F work);
+    static size_t threadCount (unsigned requested);
+    static void cutNodes     (const SentinelNode *from, const SentinelNode *to, size_t k, std::vector<DataNode*> &cuts);
+    static void chainNode    (DataNode *, DataNode **first, DataNode **last);
+    void        stitchChains (const std::vector<DataNode*> &firsts, const std::vector<DataNode*> &lasts);
+    void        freeNodes    ();
+    static int  nodeHeight   (const SentinelNode *);
+    static size_t nodeAlign  ();
+    static size_t towerBytes (int levels);
+    static char *allocNode   (int levels, size_t nodeSize);
+    static DataNode *makeNode (const ValueType &, int nodeHeight);
+    static void freeNode     (DataNode *);
+    static SentinelNode *makeSentinel ();
+    static void freeSentinel (SentinelNode *);
+    DataNode    *boundNode   (const Key_T &, bool inclusive) const;
+    void        appendNode   (DataNode *, int nodeHeight, DataNode **last);
+    void        relinkNode   (DataNode *, int nodeHeight, DataNode **last);
+    void        closeLevels  (DataNode **last, int newHeight);
+    void        countSpans   ();
+    void        lastNodes    (DataNode **last) const;
+    void        adoptVersion (uint64_t);
+    static Map  combine      (const Map &, const Map &, bool keepLhsOnly, bool keepBoth, bool keepRhsOnly);
+    DataNode    *findNode    (const Key_T &) const;
+    DataNode    *lastNode    () const;
+    DataNode    *searchStart (const Key_T &, bool inclusive, int &curLevel) const;
+    bool        indexFresh   () const;
+    void        staleIndex   ();
+    void        refreshLookups ();
+    bool        filterRejects (const Key_T &) const;
+    bool        filterFresh  () const;
+    bool        hashReady    () const;
+    bool        hashFresh    () const;
+    void        staleLookups ();
+    void        linkNode     (DataNode *, int nodeHeight);
+    DataNode    *unlinkNode  (const Key_T &);
+    void        fingerSearch (const Key_T &, DataNode **preds) const;
+    void        linkAfter    (DataNode *, int nodeHeight, DataNode **preds);
+    DataNode    *unlinkAfter (DataNode **preds);
+    void        countLinkAfter   (DataNode *, int nodeHeight, DataNode **preds);
+    void        countUnlinkAfter (DataNode **preds);
+
+    bool        snapshotsOpen   () const;
+    uint64_t    currentVersion  () const;
+    void        setLink         (SentinelNode *, int level, DataNode *);
+    void        retireNode      (DataNode *);
+    DataNode    *privateNode    (DataNode *);
+    void        openSnapshot    (uint64_t);
+    void        closeSnapshot   (uint64_t);
+    void        freeVersions    ();
+    static DataNode *linkAt     (const SentinelNode *, int level, uint64_t version);
+
+    template <typename Serializer>
+    void saveTo   (ByteWriter &, bool withHeights, const Serializer &) const;
+    template <typename Serializer>
+    void loadFrom (ByteReader &, const Serializer &);
+
+    //How nodes are allocated and how a Link refers to one. This version takes them from
+    //the heap, and a Link is the node's address.
+    template <bool Compressed, typename Unused>
+    class NodeStore {
+    public:
+      static Link     encode   (DataNode *node) { return node; }
+      static DataNode *decode  (Link link) { return link; }
+      static char     *allocate (size_t bytes, int) { return static_cast<char*>(::operator new(bytes)); }
+      static void     release  (char *mem, int) { ::operator delete(mem); }
+    }; //end class NodeStore
+
+    //With COMPRESSED_LINKS every node of every map of this type comes from one address
+    //range, reserved by the first allocation and counted in units of nodeAlign() bytes,
+    //and a Link is the number of the unit its node starts at. Unit 0 is never handed out,
+    //so Link() refers to no node. A freed block goes on the free list for its tower
+    //height (all blocks of one height are the same size) and is handed out from there.
+    template <typename Unused>
+    class NodeStore<true, Unused> {
+    public:
+      static Link encode (DataNode *node) {
+	return static_cast<Link>((reinterpret_cast<char*>(node) - base) / nodeAlign());
+      }
+      static DataNode *decode (Link link) { return reinterpret_cast<DataNode*>(base + link * nodeAlign()); }
+      static char     *allocate (size_t bytes, int levels);
+      static void     release  (char *mem, int levels);
+
+    private:
+      static char *base;                          //start of the range
+      static std::mutex lock;                     //for the rest, copies and clear() can run on several threads
+      static size_t used;                         //units handed out so far
+      static uint32_t freeBlocks[MAX_LEVELS + 1]; //first free block for every tower height, 0 if none
+    }; //end class NodeStore
+
+    //Copies of the keys a node's forward links point to, when NEXT_KEYS is set. They take
+    //one slot per level of the node's tower, in front of its links. The empty version
+    //reads the key through the link instead.
+    template <bool Enabled, typename Unused = void>
+    class NextKeys {
+    public:
+      static const size_t KEY_ALIGN = 1;
+      //bytes the tower of a node of levelsIn levels takes in front of it
+      static size_t towerBytes (int levelsIn) { return levelsIn * sizeof(Link); }
+      static size_t keyOffset  (int, int) { return 0; }
+
+      void markData () {}
+      void storeKey (void *, const DataNode *) {}
+      const Key_T &cachedKey (const void *, const DataNode *next) const { return next->key(); }
+    }; //end class NextKeys
+
+    template <typename Unused>
+    class NextKeys<true, Unused> {
+    public:
+      typedef typename std::aligned_storage<sizeof(PlainKey), alignof(PlainKey)>::type KeySlot;
+
+      NextKeys() : sentinel(true) {}
+
+      static const size_t KEY_ALIGN = alignof(KeySlot);
+      static size_t towerBytes (int levelsIn) { return linkBytes(levelsIn) + levelsIn * sizeof(KeySlot); }
+      //how far in front of a node of levelsIn levels the key for level starts
+      static size_t keyOffset  (int levelsIn, int level) { return linkBytes(levelsIn) + (level + 1) * sizeof(KeySlot); }
+
+      void markData () { sentinel = false; }
+
+      //links to head or tail have no key to copy
+      void storeKey (void *slot, const DataNode *target) {
+	if (!static_cast<const NextKeys*>(target)->sentinel)
+	  memcpy(slot, &target->key(), sizeof(PlainKey));
+      }
+
+      const Key_T &cachedKey (const void *slot, const DataNode *) const {
+	return *static_cast<const Key_T*>(slot);
+      }
+
+      bool sentinel;
+
+    private:
+      //the links, rounded up so the keys in front of them are aligned
+      static size_t linkBytes (int levelsIn) {
+	return (levelsIn * sizeof(Link) + KEY_ALIGN - 1) / KEY_ALIGN * KEY_ALIGN;
+      }
+    }; //end class NextKeys
+
+    //The number of level 0 steps each forward link of a node skips (tail is one step past
+    //the last entry), when SPAN_COUNTS is set. They take one slot per level in front of
+    //the rest of the tower. The empty version keeps none.
+    template <bool Enabled, typename Unused = void>
+    class NodeSpans {
+    public:
+      static const size_t SPAN_ALIGN = 1;
+      static size_t towerBytes (int levelsIn) { return NextKeys<NEXT_KEYS>::towerBytes(levelsIn); }
+      static size_t spanOffset (int, int) { return 0; }
+
+      void   storeSpan (void *, size_t) {}
+      size_t readSpan  (const void *) const { return 0; }
+    }; //end class NodeSpans
+
+    template <typename Unused>
+    class NodeSpans<true, Unused> {
+    public:
+      static const size_t SPAN_ALIGN = alignof(size_t);
+      static size_t towerBytes (int levelsIn) { return innerBytes(levelsIn) + levelsIn * sizeof(size_t); }
+      static size_t spanOffset (int levelsIn, int level) { return innerBytes(levelsIn) + (level + 1) * sizeof(size_t); }
+
+      void   storeSpan (void *slot, size_t spanIn) { *static_cast<size_t*>(slot) = spanIn; }
+      size_t readSpan  (const void *slot) const { return *static_cast<const size_t*>(slot); }
+
+    private:
+      //the links and keys, rounded up so the spans in front of them are aligned
+      static size_t innerBytes (int levelsIn) {
+	return (NextKeys<NEXT_KEYS>::towerBytes(levelsIn) + SPAN_ALIGN - 1) / SPAN_ALIGN * SPAN_ALIGN;
+      }
+    }; //end class NodeSpans
+
+    //The backward link on level 0, unless LINK_PREV is off. The empty version ignores
+    //writes, and nothing reads it then except lastNode(), which walks down instead.
+    template <bool Enabled, typename Unused = void>
+    class PrevLink {
+    public:
+      void     setPrev  (DataNode *) {}
+      DataNode *prevNode () const { return nullptr; }
+      Link     prevLink () const { return Link(); }
+    }; //end class PrevLink
+
+    template <typename Unused>
+    class PrevLink<true, Unused> {
+    public:
+      PrevLink() : prev() {}
+
+      void     setPrev  (DataNode *prevIn) { prev = Links::encode(prevIn); }
+      DataNode *prevNode () const { return Links::decode(prev); }
+      Link     prevLink () const { return prev; }
+
+      Link prev;
+    }; //end class PrevLink
+
+    //What snapshot() needs to know about a node, when SNAPSHOTS is set. The empty version
+    //keeps nothing, and nothing asks it for more while no snapshot can be open.
+    template <bool Enabled, typename Unused = void>
+    class NodeVersion {
+    public:
+      void        stamp       (uint64_t) {}
+      uint64_t    born        () const { return 0; }
+      LinkHistory *history    () const { return nullptr; }
+      LinkHistory **historyLink () { return nullptr; }
+    }; //end class NodeVersion
+
+    template <typename Unused>
+    class NodeVersion<true, Unused> {
     public:
-      SentinelNode() : prev(nullptr) {
-	for (int i = 0; i < MAX_LEVELS; ++i)
-	  nextNodes[i] = nullptr;
+      NodeVersion() : bornVersion(0), newest(nullptr) {}
+
+      void        stamp       (uint64_t version) { bornVersion = version; }
+      uint64_t    born        () const { return bornVersion; }
+      LinkHistory *history    () const { return newest; }
+      LinkHistory **historyLink () { return &newest; }
+
+      uint64_t bornVersion;  //write version that linked the node in
+      LinkHistory *newest;   //overwritten links still visible to snapshots, newest first
+    }; //end class NodeVersion
+
+    //A node's tower sits right in front of it in the same allocation: its links, level 0
+    //nearest the node, in front of those the keys NextKeys caches for them, and in front of
+    //those the counts NodeSpans keeps. All are found from the node's address and height,
+    //so the node only adds the height. head and tail get MAX_LEVELS links from
+    //makeSentinel(), a DataNode its tower height.
+    class SentinelNode : public NextKeys<NEXT_KEYS>, public NodeSpans<SPAN_COUNTS>, public PrevLink<LINK_PREV>,
+			 public NodeVersion<SNAPSHOTS> {
+    public:
+      explicit SentinelNode(int levelsIn) : levels(levelsIn) {
+	for (int i = 0; i < levels; ++i)
+	  linkSlot(i) = Link();
+      }
+      SentinelNode(const SentinelNode &) = delete;
+      SentinelNode &operator= (const SentinelNode &) = delete;
+
+      DataNode *next (int level) const { return Links::decode(linkSlot(level)); }
+      Link     link  (int level) const { return linkSlot(level); }
+
+      //points the link on level at target (and caches its key with NEXT_KEYS)
+      void setNext (int level, DataNode *target) {
+	linkSlot(level) = Links::encode(target);
+	this->storeKey(keySlot(level), target);
       }
 
-      DataNode *nextNodes[MAX_LEVELS];
-      DataNode *prev;
+      //key of the node that next(level) points to (which must not be tail)
+      const Key_T &nextKey (int level) const { return this->cachedKey(keySlot(level), next(level)); }
+
+      //entries the link on level skips, plus one (SPAN_COUNTS only). Kept on the levels
+      //below the map's height, head's included.
+      size_t span    (int level) const { return this->readSpan(spanSlot(level)); }
+      void   setSpan (int level, size_t spanIn) { this->storeSpan(spanSlot(level), spanIn); }
+
+      int levels;  //height of the tower
+
+    private:
+      Link       &linkSlot (int level) { return reinterpret_cast<Link*>(this)[-1 - level]; }
+      const Link &linkSlot (int level) const { return reinterpret_cast<const Link*>(this)[-1 - level]; }
+      char *keySlot (int level) const {
+	return const_cast<char*>(reinterpret_cast<const char*>(this)) - NextKeys<NEXT_KEYS>::keyOffset(levels, level);
+      }
+      char *spanSlot (int level) const {
+	return const_cast<char*>(reinterpret_cast<const char*>(this)) - NodeSpans<SPAN_COUNTS>::spanOffset(levels, level);
+      }
     }; //end class SentinelNode
 
-    class DataNode : public SentinelNode {
+    //Where a node keeps its entry: inline behind its height, or (SEPARATE_VALUES) in
+    //an allocation of its own, with a copy of the key in the node for searches. key() is
+    //the copy searches read, value the entry itself.
+    template <bool Separate, typename Unused = void>
+    class NodeEntry {
     public:
-      DataNode() = delete;
-      DataNode(ValueType valueIn) : value(valueIn) {}
+      NodeEntry(const ValueType &valueIn) : value(valueIn) {}
+
+      const Key_T &key     () const { return value.first; }
+      void        syncKey  () {}
 
       ValueType value;
+    }; //end class NodeEntry
+
+    template <typename Unused>
+    class NodeEntry<true, Unused> {
+    public:
+      NodeEntry(const ValueType &valueIn) : hotKey(valueIn.first), value(*new ValueType(valueIn)) {}
+      NodeEntry(const NodeEntry &) = delete;
+      NodeEntry &operator= (const NodeEntry &) = delete;
+      ~NodeEntry() { delete &value; }
+
+      const Key_T &key     () const { return hotKey; }
+      void        syncKey  () { hotKey = value.first; } //after NodeHandle::key() changed the entry's key
+
+      PlainKey hotKey;
+      ValueType &value;
+    }; //end class NodeEntry
+
+    //makeNode() allocates a DataNode behind a tower of the node's height, which is all it
+    //can ever be linked on. SentinelNode comes first, so the tower is right in front of it.
+    class DataNode : public SentinelNode, public NodeEntry<SEPARATE_VALUES> {
+    public:
+      DataNode() = delete;
+      DataNode(ValueType valueIn, int levelsIn) :
+	SentinelNode(levelsIn), NodeEntry<SEPARATE_VALUES>(valueIn) { this->markData(); }
     }; //end class DataNode
   }; //end class Map
 
   template <typename Key_T, typename Mapped_T>
-  Map<Key_T, Mapped_T>::Map() {
-    numNodes = 0;
-    height = 0;
-    head = new SentinelNode;
-    tail = new SentinelNode;
-    for (int curLevel = 0; curLevel < MAX_LEVELS; ++curLevel)
-      head->nextNodes[curLevel] = static_cast<DataNode*>(tail);
-    tail->prev = static_cast<DataNode*>(head);
-    
-    e.seed(r());
+  Map<Key_T, Mapped_T>::Map() : small(false), copyOnWrite(false), shareCount(nullptr), keyIndex(nullptr), keyFilter(nullptr), hashIndex(nullptr), versions(nullptr) {
+    startEmpty();
+    e.seed(newSeed());
   }   
 
   template <typename Key_T, typename Mapped_T>
-  Map<Key_T, Mapped_T>::Map(const Map &mapIn) {
-    numNodes = 0;
-    height = 0;
-    head = new SentinelNode;
-    tail = new SentinelNode;
-    for (int curLevel = 0; curLevel < MAX_LEVELS; ++curLevel)
-      head->nextNodes[curLevel] = static_cast<DataNode*>(tail);
-    tail->prev = static_cast<DataNode*>(head);
-    e.seed(r());
-    
-    DataNode *trav = mapIn.head->nextNodes[0];
-    while (trav != static_cast<DataNode*>(mapIn.tail)) {
-      insert(trav->value);
-      trav = trav->nextNodes[0];
+  Map<Key_T, Mapped_T>::Map(const Map &mapIn) : small(false), copyOnWrite(mapIn.copyOnWrite), shareCount(nullptr), keyIndex(nullptr), keyFilter(nullptr), hashIndex(nullptr), versions(nullptr) {
+    e.seed(newSeed());
+    if (mapIn.isSmall()) {
+      startEmpty();
+      entries.copyFrom(mapIn.entries);
+      return;
+    }
+    if (copyOnWrite && !mapIn.snapshotsOpen()) {
+      share(mapIn);
+      return;
     }
+    newSentinels();
+    copyNodes(mapIn.head, mapIn.tail, mapIn.numNodes);
   }
   
+  //Takes over mapIn's nodes (and the lookup structures built for them) and leaves it
+  //empty. Snapshots hold on to the map they were taken from, so a map with open snapshots
+  //is copied instead.
   template <typename Key_T, typename Mapped_T>
-  Map<Key_T, Mapped_T>& Map<Key_T, Mapped_T>::operator=(const Map<Key_T, Mapped_T> &mapIn) {
-    if (&mapIn != this) {  //check for (and ignore) self assignment
-      clear(); 
-      DataNode *trav = mapIn.head->nextNodes[0];
+  Map<Key_T, Mapped_T>::Map(Map &&mapIn) : small(false), copyOnWrite(mapIn.copyOnWrite), shareCount(nullptr), keyIndex(nullptr), keyFilter(nullptr), hashIndex(nullptr), versions(nullptr) {
+    e.seed(newSeed());
+    if (mapIn.isSmall()) {
+      startEmpty();
+      entries.moveFrom(mapIn.entries);
+      return;
+    }
+    if (mapIn.snapshotsOpen()) {
+      newSentinels();
+      copyNodes(mapIn.head, mapIn.tail, mapIn.numNodes);
+      return;
+    }
+    head = mapIn.head;
+    tail = mapIn.tail;
+    numNodes = mapIn.numNodes;
+    height = mapIn.height;
+    shareCount = mapIn.shareCount;
+    versions = mapIn.versions;
+    mapIn.shareCount = nullptr;
+    mapIn.versions = nullptr;
+    std::swap(keyIndex, mapIn.keyIndex); //built for head, which comes along
+    std::swap(keyFilter, mapIn.keyFilter);
+    std::swap(hashIndex, mapIn.hashIndex);
+    mapIn.startEmpty();
+  }
 
-      for (int curLevel = 0; curLevel < MAX_LEVELS; ++curLevel)
-	head->nextNodes[curLevel] = static_cast<DataNode*>(tail);
-      tail->prev = static_cast<DataNode*>(head);
-      
-      while (trav != static_cast<DataNode*>(mapIn.tail)) {
-	insert(trav->value);
-	trav = trav->nextNodes[0];
+  template <typename Key_T, typename Mapped_T>
+  Map<Key_T, Mapped_T>& Map<Key_T, Mapped_T>::operator=(Map<Key_T, Mapped_T> &&mapIn) {
+    if (&mapIn == this || (!isSmall() && head == mapIn.head))
+      return *this;
+    if (snapshotsOpen() || mapIn.snapshotsOpen())
+      return (*this = static_cast<const Map&>(mapIn));
+
+    if (mapIn.isSmall()) {
+      if (isSmall())
+	entries.clear();
+      else {
+	release();
+	startEmpty();
+      }
+      copyOnWrite = mapIn.copyOnWrite;
+      entries.moveFrom(mapIn.entries);
+      return *this;
+    }
+
+    //the map we empty gets new sentinels up front, so nothing can throw once we start
+    SentinelNode *newHead = nullptr;
+    SentinelNode *newTail = nullptr;
+    if (INLINE_CAPACITY == 0) {
+      newHead = makeSentinel();
+      try {
+	newTail = makeSentinel();
+      }
+      catch (...) {
+	freeSentinel(newHead);
+	throw;
+      }
+    }
+    if (isSmall()) {
+      entries.clear();
+      small = false;
+    }
+    else
+      release();
+    copyOnWrite = mapIn.copyOnWrite;
+    head = mapIn.head;
+    tail = mapIn.tail;
+    numNodes = mapIn.numNodes;
+    height = mapIn.height;
+    shareCount = mapIn.shareCount;
+    versions = mapIn.versions;
+    std::swap(keyIndex, mapIn.keyIndex); //ours go to mapIn, stale, for reuse
+    std::swap(keyFilter, mapIn.keyFilter);
+    std::swap(hashIndex, mapIn.hashIndex);
+    mapIn.staleIndex();
+    mapIn.staleLookups();
+
+    mapIn.shareCount = nullptr;
+    mapIn.versions = nullptr;
+    if (INLINE_CAPACITY > 0) {
+      mapIn.startEmpty();
+      return *this;
+    }
+    mapIn.head = newHead;
+    mapIn.tail = newTail;
+    mapIn.numNodes = 0;
+    mapIn.height = 0;
+    for (int curLevel = 0; curLevel < MAX_LEVELS; ++curLevel)
+      newHead->setNext(curLevel, static_cast<DataNode*>(newTail));
+    newTail->setPrev(static_cast<DataNode*>(newHead));
+    return *this;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  Map<Key_T, Mapped_T>& Map<Key_T, Mapped_T>::operator=(const Map<Key_T, Mapped_T> &mapIn) {
+    if (&mapIn != this && (small || mapIn.isSmall() || head != mapIn.head)) {  //check for (and ignore) self assignment
+      copyOnWrite = mapIn.copyOnWrite;
+      if (snapshotsOpen()) { //our old nodes have to stay around for the snapshots
+	clear();
+	if (mapIn.isSmall())
+	  copyEntries(mapIn.entries);
+	else
+	  copyNodes(mapIn.head, mapIn.tail, mapIn.numNodes);
+	return *this;
+      }
+      if (isSmall())
+	entries.clear();
+      else
+	release();
+      if (mapIn.isSmall()) {
+	startEmpty();
+	entries.copyFrom(mapIn.entries);
+      }
+      else if (copyOnWrite && !mapIn.snapshotsOpen()) {
+	small = false;
+	share(mapIn);
+      }
+      else {
+	small = false;
+	newSentinels();
+	copyNodes(mapIn.head, mapIn.tail, mapIn.numNodes);
       }
     }    
     return *this;
   }
   
   template <typename Key_T, typename Mapped_T>
-  Map<Key_T, Mapped_T>::Map(std::initializer_list<std::pair<const Key_T, Mapped_T>> initList) {
-    numNodes = 0;
-    height = 0;
-    e.seed(r);
-    head = new SentinelNode;
-    tail = new SentinelNode;
-    for (int curLevel = 0; curLevel < MAX_LEVELS; ++curLevel)
-      head->nextNodes[curLevel] = static_cast<DataNode*>(tail);
-    tail->prev = static_cast<DataNode*>(head);    
+  Map<Key_T, Mapped_T>::Map(std::initializer_list<std::pair<const Key_T, Mapped_T>> initList) : small(false), copyOnWrite(false), shareCount(nullptr), keyIndex(nullptr), keyFilter(nullptr), hashIndex(nullptr), versions(nullptr) {
+    e.seed(newSeed());
+    startEmpty();
 
     for (auto it = initList.begin(); it != initList.end(); ++it)
       insert ({it->first, it->second});
@@ -295,80 +1580,121 @@ namespace cs540 {
   
   template <typename Key_T, typename Mapped_T>
   Map<Key_T, Mapped_T>::~Map<Key_T, Mapped_T>() {
-    clear();
-    delete head;
-    delete tail;
+    if (!isSmall())
+      release();
+    delete keyIndex;
+    delete keyFilter;
+    delete hashIndex;
   }
-  
+
   template <typename Key_T, typename Mapped_T>
-  size_t Map<Key_T, Mapped_T>::size() const {
+  void Map<Key_T, Mapped_T>::setCopyOnWrite(bool enable) {
+    copyOnWrite = enable;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  bool Map<Key_T, Mapped_T>::isShared() const {
+    return (shareCount != nullptr && *shareCount > 1);
+  }
+  
+  template <typename Key_T, typename Mapped_T>
+  size_t Map<Key_T, Mapped_T>::size() const {
+    if (isSmall())
+      return entries.count;
     return numNodes;
   }
 
   template <typename Key_T, typename Mapped_T>
   bool Map<Key_T, Mapped_T>::empty() const {
-    return (numNodes == 0);
+    if (isSmall())
+      return (entries.count == 0);
+    return (head->next(0) == static_cast<DataNode*>(tail));
   }
   
   template <typename Key_T, typename Mapped_T>
   typename Map<Key_T, Mapped_T>::Iterator Map<Key_T, Mapped_T>::begin() {
-    Iterator retIt (head->nextNodes[0]);
+    if (isSmall())
+      return Iterator(&entries, entries.first());
+    detach();
+    Iterator retIt (head->next(0));
     return retIt;
   }
   
   template <typename Key_T, typename Mapped_T>
   typename Map<Key_T, Mapped_T>::Iterator Map<Key_T, Mapped_T>::end () {
+    if (isSmall())
+      return Iterator(&entries, InlineEntries::NONE);
+    detach();
     Iterator retIt(static_cast<DataNode*>(tail));
     return retIt;  
   }
     
   template <typename Key_T, typename Mapped_T>
   typename Map<Key_T, Mapped_T>::ConstIterator Map<Key_T, Mapped_T>::begin() const {
-    ConstIterator retIt (head->nextNodes[0]);
+    if (isSmall())
+      return ConstIterator(const_cast<InlineEntries*>(&entries), entries.first());
+    ConstIterator retIt (head->next(0));
     return retIt;
   }
 
   template <typename Key_T, typename Mapped_T>
   typename Map<Key_T, Mapped_T>::ConstIterator Map<Key_T, Mapped_T>::end() const {
+    if (isSmall())
+      return ConstIterator(const_cast<InlineEntries*>(&entries), InlineEntries::NONE);
     ConstIterator retIt(static_cast<DataNode*>(tail));
     return retIt;
   }
 
   template <typename Key_T, typename Mapped_T>
   typename Map<Key_T, Mapped_T>::ReverseIterator Map<Key_T, Mapped_T>::rbegin() {
-    ReverseIterator retIt(tail->prev);
+    if (isSmall())
+      return ReverseIterator(&entries, entries.last());
+    static_assert(LINK_PREV, "rbegin() needs MapTraits::reverseIteration");
+    detach();
+    ReverseIterator retIt(tail->prevNode());
     return retIt;
   }
 
   template <typename Key_T, typename Mapped_T>
   typename Map<Key_T, Mapped_T>::ReverseIterator Map<Key_T, Mapped_T>::rend() {
+    static_assert(LINK_PREV, "rend() needs MapTraits::reverseIteration");
+    if (isSmall())
+      return ReverseIterator(&entries, InlineEntries::NONE);
+    detach();
     ReverseIterator retIt(static_cast<DataNode*>(head));
     return retIt;
   }
 
   template <typename Key_T, typename Mapped_T>
   typename Map<Key_T, Mapped_T>::Iterator Map<Key_T, Mapped_T>::find (const Key_T &keyIn) {
-    int curLevel = height - 1;
-    DataNode *trav = static_cast<DataNode*>(head);
-    while (curLevel >= 0) {
-      while (trav->nextNodes[curLevel] != static_cast<DataNode*>(tail) && trav->nextNodes[curLevel]->value.first < keyIn)
-	trav = trav->nextNodes[curLevel];
-      if (trav->nextNodes[curLevel] != static_cast<DataNode*>(tail) && trav->nextNodes[curLevel]->value.first == keyIn)
-	return trav->nextNodes[curLevel];
-      --curLevel;
-    }
-    return static_cast<DataNode*>(tail);
+    if (isSmall())
+      return Iterator(&entries, entries.find(keyIn));
+    detach();
+    return privateNode(findNode(keyIn));
   }
 
   template <typename Key_T, typename Mapped_T>
   typename Map<Key_T, Mapped_T>::ConstIterator Map<Key_T, Mapped_T>::find (const Key_T &keyIn) const {
-    int curLevel = height - 1;
-    DataNode *trav = static_cast<DataNode*>(head);
+    if (isSmall())
+      return ConstIterator(const_cast<InlineEntries*>(&entries), entries.find(keyIn));
+    return findNode(keyIn);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename Map<Key_T, Mapped_T>::DataNode *Map<Key_T, Mapped_T>::findNode (const Key_T &keyIn) const {
+    if (hashReady()) {
+      DataNode *found = hashIndex->find(hashKey(keyIn), keyIn);
+      return (found != nullptr) ? found : static_cast<DataNode*>(tail);
+    }
+    if (filterRejects(keyIn))
+      return static_cast<DataNode*>(tail);
+    int curLevel;
+    DataNode *trav = searchStart(keyIn, true, curLevel);
     while (curLevel >= 0) {
-      while (trav->nextNodes[curLevel] != static_cast<DataNode*>(tail) && trav->nextNodes[curLevel]->value.first < keyIn)
-	trav = trav->nextNodes[curLevel];
-      if (trav->nextNodes[curLevel] != static_cast<DataNode*>(tail) && trav->nextNodes[curLevel]->value.first == keyIn)
-	return trav->nextNodes[curLevel];
+      while (trav->next(curLevel) != static_cast<DataNode*>(tail) && trav->nextKey(curLevel) < keyIn)
+	trav = trav->next(curLevel);
+      if (trav->next(curLevel) != static_cast<DataNode*>(tail) && trav->nextKey(curLevel) == keyIn)
+	return trav->next(curLevel);
       --curLevel;
     }
     return static_cast<DataNode*>(tail);    
@@ -376,10 +1702,10 @@ namespace cs540 {
   
   template <typename Key_T, typename Mapped_T>
   Mapped_T &Map<Key_T, Mapped_T>::at (const Key_T &keyIn) {
-    auto retIt = find(keyIn);
-    if (retIt == end())
+    Mapped_T *found = get_if(keyIn); //only a hit detaches a shared map
+    if (found == nullptr)
       throw std::out_of_range("value not found while using at()");
-    return (*retIt).second;
+    return *found;
   }
 
   template <typename Key_T, typename Mapped_T>
@@ -391,8 +1717,33 @@ namespace cs540 {
     
   }
 
+  template <typename Key_T, typename Mapped_T>
+  bool Map<Key_T, Mapped_T>::contains (const Key_T &keyIn) const {
+    return (find(keyIn) != end());
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  size_t Map<Key_T, Mapped_T>::count (const Key_T &keyIn) const {
+    return contains(keyIn) ? 1 : 0;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  Mapped_T *Map<Key_T, Mapped_T>::get_if (const Key_T &keyIn) {
+    if (isShared() && !contains(keyIn)) //a miss needn't clone the shared nodes
+      return nullptr;
+    auto retIt = find(keyIn);
+    return (retIt == end()) ? nullptr : &(*retIt).second;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  const Mapped_T *Map<Key_T, Mapped_T>::get_if (const Key_T &keyIn) const {
+    auto retIt = find(keyIn);
+    return (retIt == end()) ? nullptr : &(*retIt).second;
+  }
+
   template <typename Key_T, typename Mapped_T>
   Mapped_T &Map<Key_T, Mapped_T>::operator[] (const Key_T &keyIn) {
+    detach();
     auto retIt = find(keyIn);
     if (retIt == end()) {  //if key isn't in map, create a new entry for it
       Mapped_T newMapped{};
@@ -403,56 +1754,402 @@ namespace cs540 {
     return (*retIt).second;
   }
 
+  template <typename Key_T, typename Mapped_T>
+  typename Map<Key_T, Mapped_T>::Iterator Map<Key_T, Mapped_T>::lower_bound (const Key_T &keyIn) {
+    if (isSmall())
+      return Iterator(&entries, entries.atRank(entries.bound(keyIn, true)));
+    detach();
+    return privateNode(boundNode(keyIn, true));
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename Map<Key_T, Mapped_T>::ConstIterator Map<Key_T, Mapped_T>::lower_bound (const Key_T &keyIn) const {
+    if (isSmall())
+      return ConstIterator(const_cast<InlineEntries*>(&entries), entries.atRank(entries.bound(keyIn, true)));
+    return boundNode(keyIn, true);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename Map<Key_T, Mapped_T>::Iterator Map<Key_T, Mapped_T>::upper_bound (const Key_T &keyIn) {
+    if (isSmall())
+      return Iterator(&entries, entries.atRank(entries.bound(keyIn, false)));
+    detach();
+    return privateNode(boundNode(keyIn, false));
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename Map<Key_T, Mapped_T>::ConstIterator Map<Key_T, Mapped_T>::upper_bound (const Key_T &keyIn) const {
+    if (isSmall())
+      return ConstIterator(const_cast<InlineEntries*>(&entries), entries.atRank(entries.bound(keyIn, false)));
+    return boundNode(keyIn, false);
+  }
+
+  //first node whose key is >= keyIn (inclusive) or > keyIn (!inclusive), tail if there is none
+  template <typename Key_T, typename Mapped_T>
+  typename Map<Key_T, Mapped_T>::DataNode *Map<Key_T, Mapped_T>::boundNode (const Key_T &keyIn, bool inclusive) const {
+    int curLevel;
+    DataNode *trav = searchStart(keyIn, inclusive, curLevel);
+    while (curLevel >= 0) {
+      while (trav->next(curLevel) != static_cast<DataNode*>(tail) &&
+	     (inclusive ? trav->nextKey(curLevel) < keyIn : !(keyIn < trav->nextKey(curLevel))))
+	trav = trav->next(curLevel);
+      --curLevel;
+    }
+    return trav->next(0);
+  }
+
+  //Where a top-down search for keyIn starts, and on which level (curLevel). For an indexed
+  //map that is the last node on INDEX_LEVEL before keyIn (< keyIn, or <= keyIn for
+  //!inclusive), looked up in the key index, entered one level below; otherwise head.
+  //Only reads the index, which refreshLookups() keeps current.
+  template <typename Key_T, typename Mapped_T>
+  typename Map<Key_T, Mapped_T>::DataNode *Map<Key_T, Mapped_T>::searchStart (const Key_T &keyIn, bool inclusive, int &curLevel) const {
+    curLevel = height - 1;
+    if (!KEY_INDEX || height < INDEX_MIN_HEIGHT)
+      return static_cast<DataNode*>(head);
+
+    if (!indexFresh())
+      return static_cast<DataNode*>(head); //a copy-on-write copy has none until its first write
+    size_t pos = keyIndex->rank(KeyIndex::toStored(keyIn), inclusive);
+    curLevel = INDEX_LEVEL - 1;
+    return (pos == 0) ? static_cast<DataNode*>(head) : keyIndex->nodes[pos - 1];
+  }
+
+  //The first nodes of ranges 2 to k of a cut of the list between from and to into k
+  //ranges: evenly spaced nodes of the highest level with at least SAMPLES * k nodes on it
+  //(or of level 0 if the list is shorter). The gaps between the nodes of one level vary a
+  //lot, but the ranges span SAMPLES of them each, which evens them out. Since each level
+  //has about half the nodes of the one below, that walks O(k) nodes.
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::cutNodes (const SentinelNode *from, const SentinelNode *to, size_t k, std::vector<DataNode*> &cuts) {
+    static const size_t SAMPLES = 32;
+    for (int curLevel = MAX_LEVELS - 1; curLevel >= 0 && k > 1; --curLevel) {
+      size_t count = 0;
+      for (DataNode *trav = from->next(curLevel); trav != static_cast<const DataNode*>(to); trav = trav->next(curLevel))
+	++count;
+      if (count < SAMPLES * k && curLevel > 0)
+	continue;
+      k = std::min(k, count); //a map of fewer than k entries gets one range per entry
+      size_t pos = 0;
+      size_t next = 1;      //with k <= count, the positions next * count / k strictly increase
+      for (DataNode *trav = from->next(curLevel); next < k; trav = trav->next(curLevel), ++pos) {
+	if (pos == next * count / k) {
+	  cuts.push_back(trav);
+	  ++next;
+	}
+      }
+      return;
+    }
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  std::vector<std::pair<typename Map<Key_T, Mapped_T>::Iterator, typename Map<Key_T, Mapped_T>::Iterator>> Map<Key_T, Mapped_T>::partition (size_t k) {
+    std::vector<std::pair<Iterator, Iterator>> ranges;
+    k = std::max<size_t>(k, 1);
+    if (isSmall()) {
+      for (size_t r = 0; r < k; ++r) {
+	size_t from = r * entries.count / k;
+	size_t to = (r + 1) * entries.count / k;
+	if (from < to)
+	  ranges.push_back({Iterator(&entries, entries.atRank(from)), Iterator(&entries, entries.atRank(to))});
+      }
+      return ranges;
+    }
+    detach();
+    std::vector<DataNode*> cuts;
+    cutNodes(head, tail, k, cuts);
+    DataNode *from = head->next(0);
+    for (DataNode *cut : cuts) {
+      ranges.push_back({Iterator(from), Iterator(cut)});
+      from = cut;
+    }
+    if (from != static_cast<DataNode*>(tail))
+      ranges.push_back({Iterator(from), Iterator(static_cast<DataNode*>(tail))});
+    return ranges;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  std::vector<std::pair<typename Map<Key_T, Mapped_T>::ConstIterator, typename Map<Key_T, Mapped_T>::ConstIterator>> Map<Key_T, Mapped_T>::partition (size_t k) const {
+    std::vector<std::pair<ConstIterator, ConstIterator>> ranges;
+    k = std::max<size_t>(k, 1);
+    if (isSmall()) {
+      InlineEntries *inlineEntries = const_cast<InlineEntries*>(&entries);
+      for (size_t r = 0; r < k; ++r) {
+	size_t from = r * entries.count / k;
+	size_t to = (r + 1) * entries.count / k;
+	if (from < to)
+	  ranges.push_back({ConstIterator(inlineEntries, entries.atRank(from)), ConstIterator(inlineEntries, entries.atRank(to))});
+      }
+      return ranges;
+    }
+    std::vector<DataNode*> cuts;
+    cutNodes(head, tail, k, cuts);
+    DataNode *from = head->next(0);
+    for (DataNode *cut : cuts) {
+      ranges.push_back({ConstIterator(from), ConstIterator(cut)});
+      from = cut;
+    }
+    if (from != static_cast<DataNode*>(tail))
+      ranges.push_back({ConstIterator(from), ConstIterator(static_cast<DataNode*>(tail))});
+    return ranges;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  template <typename F>
+  void Map<Key_T, Mapped_T>::parallel_for_each (F f, unsigned threads) {
+    auto ranges = partition(threadCount(threads));
+    runChunks(ranges.size(), [&](size_t r) {
+      for (Iterator it = ranges[r].first; it != ranges[r].second; ++it)
+	f(*it);
+    });
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  template <typename F>
+  void Map<Key_T, Mapped_T>::parallel_for_each (F f, unsigned threads) const {
+    auto ranges = partition(threadCount(threads));
+    runChunks(ranges.size(), [&](size_t r) {
+      for (ConstIterator it = ranges[r].first; it != ranges[r].second; ++it)
+	f(*it);
+    });
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  template <typename T, typename F, typename C>
+  T Map<Key_T, Mapped_T>::parallel_reduce (T identity, F fold, C combine, unsigned threads) const {
+    auto ranges = partition(threadCount(threads));
+    std::vector<T> partial(ranges.size(), identity);
+    runChunks(ranges.size(), [&](size_t r) {
+      T acc = identity;
+      for (ConstIterator it = ranges[r].first; it != ranges[r].second; ++it)
+	acc = fold(std::move(acc), *it);
+      partial[r] = std::move(acc);
+    });
+    T result = identity;
+    for (auto &part : partial)
+      result = combine(std::move(result), part);
+    return result;
+  }
+
+  //the last node (head if there is none), found by a walk down the levels without LINK_PREV
+  template <typename Key_T, typename Mapped_T>
+  typename Map<Key_T, Mapped_T>::DataNode *Map<Key_T, Mapped_T>::lastNode () const {
+    if (LINK_PREV)
+      return tail->prevNode();
+    DataNode *trav = static_cast<DataNode*>(head);
+    for (int curLevel = height - 1; curLevel >= 0; --curLevel) {
+      while (trav->next(curLevel) != static_cast<DataNode*>(tail))
+	trav = trav->next(curLevel);
+    }
+    return trav;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  bool Map<Key_T, Mapped_T>::indexFresh () const {
+    return (KEY_INDEX && keyIndex != nullptr && !keyIndex->stale && keyIndex->builtFor == head);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::staleIndex () {
+    if (KEY_INDEX && keyIndex != nullptr)
+      keyIndex->stale = true;
+  }
+
+  //Rebuilds the lookup structures that a change left stale, once the map is tall enough
+  //to use them. Every change to the nodes ends here, so that lookups, which are const and
+  //may run on several threads at once, only ever read them.
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::refreshLookups () {
+    if (isSmall())
+      return;
+    if (KEY_INDEX && height >= INDEX_MIN_HEIGHT && !indexFresh()) {
+      if (keyIndex == nullptr)
+	keyIndex = new KeyIndex;
+      keyIndex->clear();
+      for (DataNode *trav = head->next(INDEX_LEVEL); trav != static_cast<DataNode*>(tail); trav = trav->next(INDEX_LEVEL))
+	keyIndex->insert(trav);
+      keyIndex->stale = false;
+      keyIndex->builtFor = head;
+    }
+    if (KEY_FILTER && height >= FILTER_MIN_HEIGHT && !filterFresh()) {
+      if (keyFilter == nullptr)
+	keyFilter = new KeyFilter;
+      keyFilter->reset(std::max<size_t>(2 * size(), 1024)); //room to grow before the next rebuild
+      for (DataNode *trav = head->next(0); trav != static_cast<DataNode*>(tail); trav = trav->next(0))
+	keyFilter->add(hashKey(trav->key()));
+      keyFilter->stale = false;
+      keyFilter->builtFor = head;
+    }
+    if (HASH_INDEX && height >= HASH_MIN_HEIGHT && !hashFresh()) {
+      if (hashIndex == nullptr)
+	hashIndex = new HashIndex;
+      hashIndex->reset(size());
+      for (DataNode *trav = head->next(0); trav != static_cast<DataNode*>(tail); trav = trav->next(0))
+	hashIndex->insert(hashKey(trav->key()), trav);
+      hashIndex->stale = false;
+      hashIndex->builtFor = head;
+    }
+  }
+
+  //true if keyIn is certainly not in the map, by the Bloom filter refreshLookups() keeps
+  template <typename Key_T, typename Mapped_T>
+  bool Map<Key_T, Mapped_T>::filterRejects (const Key_T &keyIn) const {
+    if (!KEY_FILTER || height < FILTER_MIN_HEIGHT || !filterFresh())
+      return false;
+    return !keyFilter->mayContain(hashKey(keyIn));
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  bool Map<Key_T, Mapped_T>::filterFresh () const {
+    return (KEY_FILTER && keyFilter != nullptr && !keyFilter->stale && keyFilter->builtFor == head);
+  }
+
+  //true if the hash index, which refreshLookups() keeps, can answer point lookups
+  template <typename Key_T, typename Mapped_T>
+  bool Map<Key_T, Mapped_T>::hashReady () const {
+    return (HASH_INDEX && height >= HASH_MIN_HEIGHT && hashFresh());
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  bool Map<Key_T, Mapped_T>::hashFresh () const {
+    return (HASH_INDEX && hashIndex != nullptr && !hashIndex->stale && hashIndex->builtFor == head);
+  }
+
+  //The Bloom filter and the hash index hold every key, so any change to the set of nodes
+  //that doesn't go through linkNode() or unlinkNode() has them rebuilt
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::staleLookups () {
+    if (KEY_FILTER && keyFilter != nullptr)
+      keyFilter->stale = true;
+    if (HASH_INDEX && hashIndex != nullptr)
+      hashIndex->stale = true;
+  }
+
   template <typename Key_T, typename Mapped_T>
   std::pair<typename Map<Key_T, Mapped_T>::Iterator, bool>  Map<Key_T, Mapped_T>::insert(const ValueType &valueIn) {
+    if (isSmall()) {
+      size_t r = entries.bound(valueIn.first, true);
+      int slot = entries.atRank(r);
+      if (slot != InlineEntries::NONE && entries.value(slot).first == valueIn.first)
+	return std::pair<Iterator, bool>(Iterator(&entries, slot), false);
+      if (entries.count < INLINE_CAPACITY)
+	return std::pair<Iterator, bool>(Iterator(&entries, entries.insertAt(r, valueIn)), true);
+      promote();
+    }
+    detach();
     //check that valueIn.key is not already in map
-    auto findIt = find(valueIn.first);
-    if (findIt != end()) {
-      std::pair<typename Map<Key_T, Mapped_T>::Iterator, bool>retPair = {findIt, false};
+    DataNode *found = findNode(valueIn.first);
+    if (found != static_cast<DataNode*>(tail)) {
+      std::pair<typename Map<Key_T, Mapped_T>::Iterator, bool>retPair = {privateNode(found), false};
       return retPair;
     }
-    std::uniform_int_distribution<int> u(0,1);
-    int insertHeight = 1;
-    bool repeat = true;
-   
-    while (repeat && insertHeight < MAX_LEVELS) {
-      repeat = u(e);
-      insertHeight++;
-     }
+    int insertHeight = randomHeight();
+    DataNode *newNode = makeNode(valueIn, insertHeight);
+    linkNode(newNode, insertHeight);
+    
+    std::pair<Map<Key_T, Mapped_T>::Iterator, bool> retPair ({newNode}, true);
+    return retPair;
+  }
+
+  //links newNode (whose key is not in the map yet) in at its key with the given tower height
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::linkNode(DataNode *newNode, int insertHeight) {
+    DataNode *preds[MAX_LEVELS];
+    DataNode *trav = static_cast<DataNode*>(head);
+    for (int curLevel = MAX_LEVELS - 1; curLevel >= 0; --curLevel) {
+      if (curLevel < height) {
+	while (trav->next(curLevel) != static_cast<DataNode*>(tail) && trav->nextKey(curLevel) < newNode->key())
+	  trav = trav->next(curLevel);
+      }
+      preds[curLevel] = trav;
+    }
+    linkAfter(newNode, insertHeight, preds);
+  }
 
+  //Moves preds[] on from the predecessors of a smaller key on each level (or head) to
+  //those of keyIn: climbs from level 0 while the next node is still before keyIn, then
+  //walks down from there, so a key d nodes further on takes O(log d) steps
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::fingerSearch(const Key_T &keyIn, DataNode **preds) const {
+    int curLevel = 0;
+    while (curLevel + 1 < height && preds[curLevel]->next(curLevel) != static_cast<DataNode*>(tail) &&
+	   preds[curLevel]->nextKey(curLevel) < keyIn)
+      ++curLevel;
+    DataNode *trav = preds[curLevel];
+    bool moved = false; //once it has moved, trav is past the old predecessors of every lower level
+    for (; curLevel >= 0; --curLevel) {
+      if (!moved)
+	trav = preds[curLevel];
+      while (trav->next(curLevel) != static_cast<DataNode*>(tail) && trav->nextKey(curLevel) < keyIn) {
+	trav = trav->next(curLevel);
+	moved = true;
+      }
+      preds[curLevel] = trav;
+    }
+  }
 
-    DataNode *newNode = new DataNode(valueIn);
+  //Links newNode in behind preds[level] on each of its levels, where preds[] are the
+  //predecessors of its key (head above the height of the map). They become newNode.
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::linkAfter(DataNode *newNode, int insertHeight, DataNode **preds) {
+    bool indexed = indexFresh(); //kept up to date here rather than rebuilt
+    newNode->stamp(currentVersion());
+    if (SPAN_COUNTS)
+      countLinkAfter(newNode, insertHeight, preds);
     ++numNodes;
     if (insertHeight > height)
       height = insertHeight;
 
+    for (int curLevel = 0; curLevel < insertHeight; ++curLevel) {
+      DataNode *tmp = preds[curLevel]->next(curLevel);
+      setLink(preds[curLevel], curLevel, newNode);
+      newNode->setNext(curLevel, tmp);
+      if (curLevel == 0) {
+	tmp->setPrev(newNode);
+	newNode->setPrev(preds[0]);
+      }
+      preds[curLevel] = newNode;
+    }
+
+    if (indexed) {
+      if (insertHeight > INDEX_LEVEL)
+	keyIndex->insert(newNode);
+      keyIndex->stale = false;
+    }
+    if (filterFresh())
+      keyFilter->add(hashKey(newNode->key()));
+    if (hashFresh())
+      hashIndex->insert(hashKey(newNode->key()), newNode);
+    refreshLookups(); //the map may have just grown tall enough for them
+  }
 
-    //int curLevel = insertHeight - 1;
-    int curLevel = height - 1;
-    DataNode *trav = static_cast<DataNode*>(head);
-    DataNode *tmp;
-    
-    while (curLevel >= 0) {
-      while (trav->nextNodes[curLevel] != static_cast<DataNode*>(tail) && trav->nextNodes[curLevel]->value.first < valueIn.first)
-	trav = trav->nextNodes[curLevel];
-      if (curLevel < insertHeight) {
-	tmp = trav->nextNodes[curLevel];
-	trav->nextNodes[curLevel] = newNode;
-	newNode->nextNodes[curLevel] = tmp;
-	if (curLevel == 0) {
-	  tmp->prev = newNode;
-	  newNode->prev = trav;
-	}
+  //The spans for linkAfter(), before it links newNode in: newNode takes over the part of
+  //every link it cuts that lies behind it, and the links over it get one longer. dist is
+  //how far newNode lands behind preds[level], which adds up the spans on the level below
+  //from preds[level] to preds[level - 1].
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::countLinkAfter(DataNode *newNode, int insertHeight, DataNode **preds) {
+    for (int curLevel = height; curLevel < insertHeight; ++curLevel)
+      head->setSpan(curLevel, numNodes + 1); //a new level starts out as a link from head to tail
+    size_t dist = 1;
+    for (int curLevel = 0; curLevel < std::max(height, insertHeight); ++curLevel) {
+      if (curLevel >= insertHeight) {
+	preds[curLevel]->setSpan(curLevel, preds[curLevel]->span(curLevel) + 1);
+	continue;
       }
-      --curLevel;
+      if (curLevel > 0) {
+	for (DataNode *trav = preds[curLevel]; trav != preds[curLevel - 1]; trav = trav->next(curLevel - 1))
+	  dist += trav->span(curLevel - 1);
+      }
+      newNode->setSpan(curLevel, preds[curLevel]->span(curLevel) + 1 - dist);
+      preds[curLevel]->setSpan(curLevel, dist);
     }
-    
-    std::pair<Map<Key_T, Mapped_T>::Iterator, bool> retPair ({newNode}, true);
-    return retPair;
   }
 
   template <typename Key_T, typename Mapped_T>
   void  Map<Key_T, Mapped_T>::traceInsert(const ValueType &valueIn) {
+    promote();
+    detach();
     //check that valueIn.key is not already in map
     auto findIt = find(valueIn.first);
     if (findIt != end()) {
@@ -462,18 +2159,13 @@ namespace cs540 {
     }
     
 
-    int insertHeight = 1;
-    bool repeat = true;
-    std::uniform_int_distribution<int> u(0,1);    
-
-    while (repeat && insertHeight < MAX_LEVELS) {
-      repeat = u(e);
-      insertHeight++;
-    }
+    int insertHeight = randomHeight();
     
     printf("inserting %d at height %d\n", valueIn.first, insertHeight);
+    staleLookups();
 
-    DataNode *newNode = new DataNode(valueIn);
+    DataNode *newNode = makeNode(valueIn, insertHeight);
+    newNode->stamp(currentVersion());
     ++numNodes;
     if (insertHeight > height)
       height = insertHeight;
@@ -485,23 +2177,25 @@ namespace cs540 {
     
     while (curLevel >= 0) {
       //printf("at level %d\n", curLevel);
-      while (trav->nextNodes[curLevel] != static_cast<DataNode*>(tail) && trav->nextNodes[curLevel]->value.first < valueIn.first) {
-	printf("moving to level %d node %d\n", curLevel, trav->nextNodes[curLevel]->value.first);
-	trav = trav->nextNodes[curLevel];
+      while (trav->next(curLevel) != static_cast<DataNode*>(tail) && trav->nextKey(curLevel) < valueIn.first) {
+	printf("moving to level %d node %d\n", curLevel, trav->nextKey(curLevel));
+	trav = trav->next(curLevel);
 	//printf("moving to node %d\n", trav->value.first);
       }
       if (curLevel < insertHeight) {
-	tmp = trav->nextNodes[curLevel];
-	trav->nextNodes[curLevel] = newNode;
-	newNode->nextNodes[curLevel] = tmp;
+	tmp = trav->next(curLevel);
+	setLink(trav, curLevel, newNode);
+	newNode->setNext(curLevel, tmp);
 	if (curLevel == 0) {
-	  tmp->prev = newNode;
-	  newNode->prev = trav;
+	  tmp->setPrev(newNode);
+	  newNode->setPrev(trav);
 	}
       }
       --curLevel;
     }
     printf("\n");
+    countSpans();
+    refreshLookups();
 
 
   }
@@ -517,6 +2211,235 @@ namespace cs540 {
     }
   }
 
+  //preds[] starts out at head on every level and is carried forward by fingerSearch()
+  //from key to key. Inline entries are inserted one by one until the map grows out of them.
+  template <typename Key_T, typename Mapped_T>
+  template <typename IT_T>
+  size_t Map<Key_T, Mapped_T>::insert_sorted_batch (IT_T range_beg, IT_T range_end) {
+    size_t inserted = 0;
+    IT_T trav = range_beg;
+    for (; trav != range_end && isSmall(); ++trav)
+      inserted += insert({(*trav).first, (*trav).second}).second;
+    if (trav == range_end)
+      return inserted;
+    detach();
+    DataNode *preds[MAX_LEVELS];
+    std::fill(preds, preds + MAX_LEVELS, static_cast<DataNode*>(head));
+    for (; trav != range_end; ++trav) {
+      const Key_T &keyIn = (*trav).first;
+      if (preds[0] != static_cast<DataNode*>(head) && !(preds[0]->key() < keyIn)) //out of order
+	std::fill(preds, preds + MAX_LEVELS, static_cast<DataNode*>(head));
+      fingerSearch(keyIn, preds);
+      if (preds[0]->next(0) != static_cast<DataNode*>(tail) && preds[0]->nextKey(0) == keyIn)
+	continue;
+      int insertHeight = randomHeight();
+      linkAfter(makeNode({keyIn, (*trav).second}, insertHeight), insertHeight, preds);
+      ++inserted;
+    }
+    return inserted;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  template <typename IT_T>
+  size_t Map<Key_T, Mapped_T>::erase_sorted_batch (IT_T range_beg, IT_T range_end) {
+    size_t erased = 0;
+    if (isSmall()) {
+      for (IT_T trav = range_beg; trav != range_end; ++trav)
+	erased += erase(*trav, std::nothrow);
+      return erased;
+    }
+    if (range_beg == range_end)
+      return 0;
+    detach();
+    DataNode *preds[MAX_LEVELS];
+    std::fill(preds, preds + MAX_LEVELS, static_cast<DataNode*>(head));
+    for (IT_T trav = range_beg; trav != range_end; ++trav) {
+      const Key_T &keyIn = *trav;
+      if (hashReady() ? hashIndex->find(hashKey(keyIn), keyIn) == nullptr : filterRejects(keyIn))
+	continue;
+      if (preds[0] != static_cast<DataNode*>(head) && !(preds[0]->key() < keyIn))
+	std::fill(preds, preds + MAX_LEVELS, static_cast<DataNode*>(head));
+      fingerSearch(keyIn, preds);
+      if (preds[0]->next(0) == static_cast<DataNode*>(tail) || !(preds[0]->nextKey(0) == keyIn))
+	continue;
+      retireNode(unlinkAfter(preds));
+      ++erased;
+    }
+    return erased;
+  }
+
+  //The input is cut into one chunk per thread. Each thread makes the nodes of its chunk and
+  //stable-sorts the pointers to them, the sorted runs are merged pairwise (in parallel too),
+  //and then each thread links its share of the sorted nodes on every level, remembering the
+  //first and last node it linked per level. Only those ends are stitched together here.
+  template <typename Key_T, typename Mapped_T>
+  template <typename IT_T>
+  void Map<Key_T, Mapped_T>::build (IT_T range_beg, IT_T range_end, unsigned threads) {
+    static const size_t MIN_CHUNK = 4096; //entries worth a thread of their own
+
+    size_t total = 0;
+    for (IT_T trav = range_beg; trav != range_end; ++trav)
+      ++total;
+    size_t chunks = std::max<size_t>(1, std::min(threadCount(threads), total / MIN_CHUNK));
+
+    std::vector<IT_T> chunkBeg;
+    std::vector<size_t> bounds; //chunk c covers nodes[bounds[c], bounds[c + 1])
+    std::vector<unsigned> seeds;
+    IT_T trav = range_beg;
+    for (size_t c = 0; c < chunks; ++c) {
+      chunkBeg.push_back(trav);
+      bounds.push_back(total * c / chunks);
+      seeds.push_back(newSeed());
+      for (size_t i = total * c / chunks; i < total * (c + 1) / chunks; ++i)
+	++trav;
+    }
+    bounds.push_back(total);
+
+    clear();
+    promote(); //the entries are linked in as nodes
+    std::vector<DataNode*> nodes(total, nullptr);
+    auto keyLess = [](const DataNode *lhs, const DataNode *rhs) { return lhs->key() < rhs->key(); };
+    try {
+      runChunks(chunks, [&](size_t c) {
+	std::default_random_engine heights(seeds[c]);
+	IT_T in = chunkBeg[c];
+	for (size_t i = bounds[c]; i < bounds[c + 1]; ++i, ++in)
+	  nodes[i] = makeNode(ValueType((*in).first, (*in).second), randomHeight(heights));
+	std::stable_sort(nodes.begin() + bounds[c], nodes.begin() + bounds[c + 1], keyLess);
+      });
+    }
+    catch (...) {
+      for (size_t i = 0; i < total; ++i)
+	freeNode(nodes[i]);
+      throw;
+    }
+
+    //merging neighbouring runs keeps the entries of equal keys in input order
+    for (size_t width = 1; width < chunks; width *= 2) {
+      runChunks((chunks + 2 * width - 1) / (2 * width), [&](size_t pair) {
+	size_t lo = 2 * width * pair;
+	if (lo + width < chunks)
+	  std::inplace_merge(nodes.begin() + bounds[lo], nodes.begin() + bounds[lo + width],
+			     nodes.begin() + bounds[std::min(lo + 2 * width, chunks)], keyLess);
+      });
+    }
+
+    std::vector<char> keep(total);
+    runChunks(chunks, [&](size_t c) {
+      for (size_t i = bounds[c]; i < bounds[c + 1]; ++i)
+	keep[i] = (i == 0 || nodes[i - 1]->key() < nodes[i]->key());
+    });
+
+    std::vector<DataNode*> firsts(chunks * MAX_LEVELS, nullptr);
+    std::vector<DataNode*> lasts(chunks * MAX_LEVELS, nullptr);
+    std::vector<size_t> kept(chunks, 0);
+    uint64_t born = currentVersion();
+    runChunks(chunks, [&](size_t c) {
+      for (size_t i = bounds[c]; i < bounds[c + 1]; ++i) {
+	if (!keep[i]) {
+	  freeNode(nodes[i]);
+	  continue;
+	}
+	nodes[i]->stamp(born);
+	chainNode(nodes[i], &firsts[c * MAX_LEVELS], &lasts[c * MAX_LEVELS]);
+	++kept[c];
+      }
+    });
+    stitchChains(firsts, lasts);
+    for (size_t c = 0; c < chunks; ++c)
+      numNodes += kept[c];
+    refreshLookups();
+  }
+
+  //Appends node to a chain of nodes that isn't linked into a map yet: first[level] and
+  //last[level] are the ends of the chain on each level (nullptr while it has none there).
+  //Its last links stay null, and the first node's prev link is set by stitchChains().
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::chainNode (DataNode *node, DataNode **first, DataNode **last) {
+    node->setPrev(last[0]);
+    for (int curLevel = 0; curLevel < node->levels; ++curLevel) {
+      if (last[curLevel] == nullptr)
+	first[curLevel] = node;
+      else
+	last[curLevel]->setNext(curLevel, node);
+      last[curLevel] = node;
+    }
+  }
+
+  //Links chains built by chainNode() into this (empty) map one after the other, by their
+  //ends only. The ends of chain c are firsts/lasts[c * MAX_LEVELS + level].
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::stitchChains (const std::vector<DataNode*> &firsts, const std::vector<DataNode*> &lasts) {
+    DataNode *last[MAX_LEVELS];
+    for (int curLevel = 0; curLevel < MAX_LEVELS; ++curLevel)
+      last[curLevel] = static_cast<DataNode*>(head);
+    int newHeight = 0;
+    for (size_t c = 0; c < firsts.size(); c += MAX_LEVELS) {
+      if (firsts[c] != nullptr)
+	firsts[c]->setPrev(last[0]);
+      for (int curLevel = 0; curLevel < MAX_LEVELS && firsts[c + curLevel] != nullptr; ++curLevel) {
+	DataNode *first = firsts[c + curLevel];
+	if (last[curLevel] == static_cast<DataNode*>(head))
+	  setLink(head, curLevel, first);
+	else
+	  last[curLevel]->setNext(curLevel, first);
+	last[curLevel] = lasts[c + curLevel];
+	newHeight = std::max(newHeight, curLevel + 1);
+      }
+    }
+    for (int curLevel = 0; curLevel < newHeight; ++curLevel) {
+      last[curLevel]->setNext(curLevel, static_cast<DataNode*>(tail));
+    }
+    tail->setPrev(last[0]);
+    height = newHeight;
+    countSpans();
+    staleIndex();
+    staleLookups();
+  }
+
+  //Calls work(c) for every chunk c in [0, chunks), each on a thread of its own (chunk 0 on
+  //the calling thread, and any chunk no thread could be started for as well), waits for
+  //all of them and rethrows the first exception one of them threw
+  template <typename Key_T, typename Mapped_T>
+  template <typename F>
+  void Map<Key_T, Mapped_T>::runChunks (size_t chunks, F work) {
+    if (chunks == 0)
+      return;
+    std::vector<std::exception_ptr> errors(chunks);
+    auto guarded = [&](size_t c) {
+      try {
+	work(c);
+      }
+      catch (...) {
+	errors[c] = std::current_exception();
+      }
+    };
+    std::vector<std::thread> workers;
+    std::vector<size_t> inlineChunks(1, 0);
+    for (size_t c = 1; c < chunks; ++c) {
+      try {
+	workers.emplace_back(guarded, c);
+      }
+      catch (const std::system_error &) {
+	inlineChunks.push_back(c);
+      }
+    }
+    for (size_t c : inlineChunks)
+      guarded(c);
+    for (auto &worker : workers)
+      worker.join();
+    for (auto &error : errors) {
+      if (error)
+	std::rethrow_exception(error);
+    }
+  }
+
+  //the requested number of threads, or one per core for 0
+  template <typename Key_T, typename Mapped_T>
+  size_t Map<Key_T, Mapped_T>::threadCount (unsigned requested) {
+    return (requested > 0) ? requested : std::max(1u, std::thread::hardware_concurrency());
+  }
+
   template <typename Key_T, typename Mapped_T>
   void Map<Key_T, Mapped_T>::erase (Map<Key_T, Mapped_T>::Iterator pos) {
     erase((*pos).first);
@@ -524,72 +2447,1235 @@ namespace cs540 {
   
   template <typename Key_T, typename Mapped_T>
   void Map<Key_T, Mapped_T>::erase (const Key_T &keyIn) {
-    DataNode *toDelete = nullptr;
-    
+    if (erase(keyIn, std::nothrow) == 0)
+      throw std::out_of_range("attempted to delete a key which is not in the map");
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  size_t Map<Key_T, Mapped_T>::erase (const Key_T &keyIn, const std::nothrow_t &) {
+    if (isSmall()) {
+      int slot = entries.find(keyIn);
+      if (slot == InlineEntries::NONE)
+	return 0;
+      entries.erase(slot);
+      return 1;
+    }
+    if (isShared() && !contains(keyIn)) //a miss needn't clone the shared nodes
+      return 0;
+    detach();
+    DataNode *toDelete = unlinkNode(keyIn);
+    if (toDelete == nullptr)
+      return 0;
+    retireNode(toDelete);
+    return 1;
+  }
+
+  //takes the node with keyIn out of the live map and returns it, nullptr if there is none
+  template <typename Key_T, typename Mapped_T>
+  typename Map<Key_T, Mapped_T>::DataNode *Map<Key_T, Mapped_T>::unlinkNode (const Key_T &keyIn) {
+    if (hashReady() ? hashIndex->find(hashKey(keyIn), keyIn) == nullptr : filterRejects(keyIn))
+      return nullptr;
+    DataNode *preds[MAX_LEVELS];
     int curLevel = height - 1;
     DataNode *trav = static_cast<DataNode*>(head);
 
     while (curLevel >= 0) {
-      while (trav->nextNodes[curLevel] != static_cast<DataNode*>(tail) &&  trav->nextNodes[curLevel]->value.first < keyIn)
-	trav = trav->nextNodes[curLevel];
-      if (trav->nextNodes[curLevel] != static_cast<DataNode*>(tail) && trav->nextNodes[curLevel]->value.first == keyIn) {
-	toDelete = trav->nextNodes[curLevel];
-	trav->nextNodes[curLevel] = trav->nextNodes[curLevel]->nextNodes[curLevel];
-	if (curLevel == 0)
-	  trav->nextNodes[curLevel]->prev = trav;
-      }
+      while (trav->next(curLevel) != static_cast<DataNode*>(tail) &&  trav->nextKey(curLevel) < keyIn)
+	trav = trav->next(curLevel);
+      preds[curLevel] = trav;
       --curLevel;
     }
+    if (trav->next(0) == static_cast<DataNode*>(tail) || !(trav->nextKey(0) == keyIn))
+      return nullptr;
+    return unlinkAfter(preds);
+  }
+
+  //Takes the node behind preds[0] out of the live map and returns it, where preds[] are
+  //the predecessors of its key on every level of the map (they stay valid)
+  template <typename Key_T, typename Mapped_T>
+  typename Map<Key_T, Mapped_T>::DataNode *Map<Key_T, Mapped_T>::unlinkAfter (DataNode **preds) {
+    bool indexed = indexFresh();
+    DataNode *toDelete = preds[0]->next(0);
+    if (SPAN_COUNTS)
+      countUnlinkAfter(preds);
+    int curLevel;
+    for (curLevel = nodeHeight(toDelete) - 1; curLevel >= 0; --curLevel) {
+      setLink(preds[curLevel], curLevel, toDelete->next(curLevel));
+      if (curLevel == 0)
+	preds[0]->next(0)->setPrev(preds[0]);
+    }
 
-    if (toDelete == nullptr)
-      throw std::out_of_range("attempted to delete a key which is not in the map");
-    delete toDelete;
     --numNodes;
+    if (indexed) {
+      if (nodeHeight(toDelete) > INDEX_LEVEL)
+	keyIndex->erase(toDelete);
+      keyIndex->stale = false;
+    }
+    if (filterFresh())
+      keyFilter->remove();
+    if (hashFresh())
+      hashIndex->erase(hashKey(toDelete->key()), toDelete);
 
     //update height in case we just deleted the only elem from the top level
     for (curLevel = height - 1; curLevel >= 0; --curLevel) {
-      if (head->nextNodes[curLevel] != static_cast<DataNode*>(tail)) {
+      if (head->next(curLevel) != static_cast<DataNode*>(tail)) {
 	height = curLevel + 1;
 	break;
       }
     }
+    refreshLookups();
+    return toDelete;
   }
-  
+
+  //The spans for unlinkAfter(), before it unlinks the node behind preds[0]: the links
+  //that pointed at it take over its own, and the links over it get one shorter
   template <typename Key_T, typename Mapped_T>
-  void Map<Key_T, Mapped_T>::clear() {
-    DataNode *trav = head->nextNodes[0];
-    DataNode *prev;
-    while (trav != static_cast<DataNode*>(tail)) {
-      prev = trav;
-      trav = trav->nextNodes[0];
-      delete prev;
+  void Map<Key_T, Mapped_T>::countUnlinkAfter(DataNode **preds) {
+    DataNode *toDelete = preds[0]->next(0);
+    for (int curLevel = 0; curLevel < height; ++curLevel) {
+      size_t span = preds[curLevel]->span(curLevel) - 1;
+      if (curLevel < nodeHeight(toDelete))
+	span += toDelete->span(curLevel);
+      preds[curLevel]->setSpan(curLevel, span);
     }
-    
-    for (int curLevel = 0; curLevel < MAX_LEVELS; ++curLevel)
-      head->nextNodes[curLevel] = static_cast<DataNode*>(tail);
-    tail->prev = static_cast<DataNode*>(head);
-    height = 0;
-    numNodes = 0;
   }
 
   template <typename Key_T, typename Mapped_T>
-  void Map<Key_T, Mapped_T>::print() const {
-    DataNode *trav;
-    printf("numNodes=%lu, height=%d\n", numNodes, height);
-    for(int i = height - 1; i >= 0; --i) {
-      printf("level %d:", i);
-      trav = head->nextNodes[i];
-      while (trav != static_cast<DataNode*>(tail)) {
-	printf("-->{%d, %d}", trav->value.first, trav->value.second);
-	trav = trav->nextNodes[i];
-      }
-      printf("\n");
-    }
-    printf("reverse level 0:");
-    trav = tail->prev;
-    while (trav != static_cast<DataNode*>(head)) {
-      printf("-->{%d, %d}", trav->value.first, trav->value.second);
-      trav = trav->prev;
+  typename Map<Key_T, Mapped_T>::NodeHandle Map<Key_T, Mapped_T>::extract (const Key_T &keyIn) {
+    promote();
+    detach();
+    DataNode *node = unlinkNode(keyIn);
+    if (node == nullptr)
+      return NodeHandle();
+    if (snapshotsOpen() && (node->born() <= versions->open.back().first || node->history() != nullptr)) {
+      DataNode *copy = makeNode(node->value, nodeHeight(node)); //the snapshots keep the original
+      retireNode(node);
+      node = copy;
+    }
+    return NodeHandle(node);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename Map<Key_T, Mapped_T>::NodeHandle Map<Key_T, Mapped_T>::extract (Iterator pos) {
+    return extract((*pos).first);
+  }
+
+  //the node keeps the tower height it had, its old links are overwritten while linking
+  template <typename Key_T, typename Mapped_T>
+  typename Map<Key_T, Mapped_T>::InsertReturn Map<Key_T, Mapped_T>::insert (NodeHandle &&handleIn) {
+    if (handleIn.empty())
+      return InsertReturn{end(), false, NodeHandle()};
+    promote();
+    detach();
+    handleIn.node->syncKey();
+    DataNode *found = findNode(handleIn.node->key());
+    if (found != static_cast<DataNode*>(tail))
+      return InsertReturn{privateNode(found), false, std::move(handleIn)};
+
+    DataNode *node = handleIn.node;
+    handleIn.node = nullptr;
+    linkNode(node, node->levels); //copies made by extract() have no links yet, but the same tower size
+    return InsertReturn{node, true, NodeHandle()};
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename Map<Key_T, Mapped_T>::NodeHandle &Map<Key_T, Mapped_T>::NodeHandle::operator= (NodeHandle &&handleIn) {
+    if (&handleIn != this) {
+      freeNode(node);
+      node = handleIn.node;
+      handleIn.node = nullptr;
+    }
+    return *this;
+  }
+  
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::clear() {
+    if (isSmall()) {
+      entries.clear();
+      return;
+    }
+    if (shareCount != nullptr) { //leave the shared nodes to the other maps
+      release();
+      newSentinels();
+      return;
+    }
+    if (snapshotsOpen()) { //the nodes are retired instead of freed
+      DataNode *trav = head->next(0);
+      while (trav != static_cast<DataNode*>(tail)) {
+	DataNode *next = trav->next(0);
+	retireNode(trav);
+	trav = next;
+      }
+      for (int curLevel = 0; curLevel < height; ++curLevel)
+	setLink(head, curLevel, static_cast<DataNode*>(tail));
+      tail->setPrev(static_cast<DataNode*>(head));
+      staleLookups();
+      height = 0;
+      numNodes = 0;
+      return;
+    }
+
+    freeNodes();
+    for (int curLevel = 0; curLevel < MAX_LEVELS; ++curLevel)
+      head->setNext(curLevel, static_cast<DataNode*>(tail));
+    tail->setPrev(static_cast<DataNode*>(head));
+    staleIndex();
+    staleLookups();
+    height = 0;
+    numNodes = 0;
+  }
+
+  //Deletes every node between head and tail (without unlinking them). With COPY_THREADS
+  //other than 1, a large map is cut into one segment per thread, which are freed concurrently.
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::freeNodes() {
+    std::vector<DataNode*> bounds(1, head->next(0));
+    if (COPY_THREADS != 1 && numNodes >= PARALLEL_MIN_SIZE)
+      cutNodes(head, tail, threadCount(COPY_THREADS), bounds);
+    bounds.push_back(static_cast<DataNode*>(tail));
+    runChunks(bounds.size() - 1, [&](size_t c) {
+      DataNode *trav = bounds[c];
+      while (trav != bounds[c + 1]) {
+	DataNode *next = trav->next(0);
+	freeNode(trav);
+	trav = next;
+      }
+    });
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::merge(Map &source) {
+    if (&source == this)
+      return;
+    if (source.snapshotsOpen())
+      throw std::logic_error("cannot merge from a map with open snapshots");
+    promote();
+    source.promote();
+    detach();
+    source.detach();
+
+    //Both level 0 lists are walked in step and every node is relinked at the end of the
+    //map it belongs to afterwards. Links are only rewritten behind the walk, so the next
+    //node on either side is always read from an untouched link.
+    DataNode *last[MAX_LEVELS];
+    DataNode *sourceLast[MAX_LEVELS];
+    for (int curLevel = 0; curLevel < MAX_LEVELS; ++curLevel) {
+      last[curLevel] = static_cast<DataNode*>(head);
+      sourceLast[curLevel] = static_cast<DataNode*>(source.head);
+    }
+    int newHeight = 0;
+    int sourceHeight = 0;
+    size_t moved = 0;
+    DataNode *ours = head->next(0);
+    DataNode *theirs = source.head->next(0);
+    while (ours != static_cast<DataNode*>(tail) || theirs != static_cast<DataNode*>(source.tail)) {
+      bool takeOurs = (theirs == static_cast<DataNode*>(source.tail) ||
+		       (ours != static_cast<DataNode*>(tail) && !(theirs->key() < ours->key())));
+      if (takeOurs) {
+	bool duplicate = (theirs != static_cast<DataNode*>(source.tail) && ours->key() == theirs->key());
+	DataNode *next = ours->next(0);
+	int nodeHeight = Map::nodeHeight(ours);
+	relinkNode(ours, nodeHeight, last);
+	newHeight = std::max(newHeight, nodeHeight);
+	ours = next;
+	if (!duplicate)
+	  continue;
+	//the source keeps its entry for a key we already have
+	next = theirs->next(0);
+	nodeHeight = Map::nodeHeight(theirs);
+	source.relinkNode(theirs, nodeHeight, sourceLast);
+	sourceHeight = std::max(sourceHeight, nodeHeight);
+	theirs = next;
+      }
+      else {
+	DataNode *next = theirs->next(0);
+	int nodeHeight = Map::nodeHeight(theirs);
+	theirs->stamp(currentVersion());
+	relinkNode(theirs, nodeHeight, last);
+	newHeight = std::max(newHeight, nodeHeight);
+	++moved;
+	theirs = next;
+      }
+    }
+    closeLevels(last, newHeight);
+    source.closeLevels(sourceLast, sourceHeight);
+    staleLookups();
+    source.staleLookups();
+    numNodes += moved;
+    source.numNodes -= moved;
+    refreshLookups();
+    source.refreshLookups();
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::merge(Map &&source) {
+    merge(source);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  Map<Key_T, Mapped_T> Map<Key_T, Mapped_T>::split(const Key_T &keyIn) {
+    if (snapshotsOpen())
+      throw std::logic_error("cannot split a map with open snapshots");
+    promote();
+    detach();
+    Map upper;
+    upper.promote();
+    upper.copyOnWrite = copyOnWrite;
+    upper.adoptVersion(currentVersion()); //keeps the moved nodes visible to the upper map's snapshots
+
+    //update[l] is the last node on level l that stays here, and with SPAN_COUNTS pos[l]
+    //is its position (head is 0)
+    DataNode *update[MAX_LEVELS];
+    size_t pos[MAX_LEVELS];
+    DataNode *trav = static_cast<DataNode*>(head);
+    size_t travPos = 0;
+    for (int curLevel = MAX_LEVELS - 1; curLevel >= 0; --curLevel) {
+      if (curLevel < height) {
+	while (trav->next(curLevel) != static_cast<DataNode*>(tail) && trav->nextKey(curLevel) < keyIn) {
+	  travPos += trav->span(curLevel);
+	  trav = trav->next(curLevel);
+	}
+      }
+      update[curLevel] = trav;
+      pos[curLevel] = travPos;
+    }
+    if (SPAN_COUNTS) { //the upper half starts at pos[0] + 1, and our new tail goes there
+      for (int curLevel = 0; curLevel < height; ++curLevel) {
+	upper.head->setSpan(curLevel, pos[curLevel] + update[curLevel]->span(curLevel) - pos[0]);
+	update[curLevel]->setSpan(curLevel, pos[0] + 1 - pos[curLevel]);
+      }
+    }
+
+    //the upper map takes over our tail, which its last nodes already point to, and we get
+    //its fresh one
+    bool allStay = (update[0]->next(0) == static_cast<DataNode*>(tail));
+    SentinelNode *newTail = upper.tail;
+    upper.tail = tail;
+    tail = newTail;
+    for (int curLevel = 0; curLevel < MAX_LEVELS; ++curLevel) {
+      upper.head->setNext(curLevel, update[curLevel]->next(curLevel));
+      update[curLevel]->setNext(curLevel, static_cast<DataNode*>(tail));
+    }
+    staleIndex();
+    staleLookups();
+    if (allStay)
+      upper.tail->setPrev(static_cast<DataNode*>(upper.head));
+    else
+      upper.head->next(0)->setPrev(static_cast<DataNode*>(upper.head));
+    tail->setPrev(update[0]);
+
+    upper.height = height;
+    while (upper.height > 0 && upper.head->next(upper.height - 1) == static_cast<DataNode*>(upper.tail))
+      --upper.height;
+    while (height > 0 && head->next(height - 1) == static_cast<DataNode*>(tail))
+      --height;
+
+    if (SPAN_COUNTS)
+      upper.numNodes = numNodes - pos[0];
+    else {
+      //count the shorter half, walking both in step from their fronts until one ends
+      size_t counted = 0;
+      DataNode *lower = head->next(0);
+      DataNode *moved = upper.head->next(0);
+      while (lower != static_cast<DataNode*>(tail) && moved != static_cast<DataNode*>(upper.tail)) {
+	lower = lower->next(0);
+	moved = moved->next(0);
+	++counted;
+      }
+      upper.numNodes = (moved == static_cast<DataNode*>(upper.tail)) ? counted : numNodes - counted;
+    }
+    numNodes -= upper.numNodes;
+    refreshLookups();
+    upper.refreshLookups();
+    return upper;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::join(Map &&other) {
+    if (other.empty())
+      return;
+    if (&other == this)
+      throw std::invalid_argument("cannot join a map with itself");
+    if (other.snapshotsOpen())
+      throw std::logic_error("cannot join a map with open snapshots");
+    promote();
+    other.promote();
+    detach();
+    other.detach();
+
+    bool append = empty() || lastNode()->key() < other.head->next(0)->key();
+    if (!append && !(other.lastNode()->key() < head->next(0)->key()))
+      throw std::invalid_argument("join() needs maps whose key ranges don't overlap");
+
+    if (snapshotsOpen()) { //the incoming nodes are new to our snapshots
+      for (DataNode *trav = other.head->next(0); trav != static_cast<DataNode*>(other.tail); trav = trav->next(0))
+	trav->stamp(currentVersion());
+    }
+    else
+      adoptVersion(other.currentVersion());
+
+    DataNode *otherLast[MAX_LEVELS];
+    other.lastNodes(otherLast);
+    int joinedHeight = std::max(height, other.height);
+    if (SPAN_COUNTS) {
+      for (int curLevel = height; curLevel < other.height; ++curLevel)
+	head->setSpan(curLevel, numNodes + 1); //a new level starts out as a link from head to tail
+    }
+    if (append) {
+      DataNode *last[MAX_LEVELS];
+      lastNodes(last);
+      //our links to tail now reach over other's entries, and other's stay as they are
+      if (SPAN_COUNTS) {
+	for (int curLevel = 0; curLevel < joinedHeight; ++curLevel) {
+	  size_t added = (curLevel < other.height) ? other.head->span(curLevel) - 1 : other.numNodes;
+	  last[curLevel]->setSpan(curLevel, last[curLevel]->span(curLevel) + added);
+	}
+      }
+      for (int curLevel = 0; curLevel < other.height; ++curLevel) {
+	setLink(last[curLevel], curLevel, other.head->next(curLevel));
+	setLink(otherLast[curLevel], curLevel, static_cast<DataNode*>(tail));
+      }
+      other.head->next(0)->setPrev(last[0]);
+      tail->setPrev(otherLast[0]);
+    }
+    else {
+      //head's links take over other's first ones or reach over all its entries, and other's
+      //links to tail reach on into ours
+      if (SPAN_COUNTS) {
+	for (int curLevel = 0; curLevel < joinedHeight; ++curLevel) {
+	  if (curLevel < other.height) {
+	    otherLast[curLevel]->setSpan(curLevel, otherLast[curLevel]->span(curLevel) - 1 + head->span(curLevel));
+	    head->setSpan(curLevel, other.head->span(curLevel));
+	  }
+	  else
+	    head->setSpan(curLevel, head->span(curLevel) + other.numNodes);
+	}
+      }
+      for (int curLevel = 0; curLevel < other.height; ++curLevel) {
+	setLink(otherLast[curLevel], curLevel, head->next(curLevel));
+	setLink(head, curLevel, other.head->next(curLevel));
+      }
+      otherLast[0]->next(0)->setPrev(otherLast[0]);
+      other.head->next(0)->setPrev(static_cast<DataNode*>(head));
+    }
+    height = joinedHeight;
+    numNodes += other.numNodes;
+
+    for (int curLevel = 0; curLevel < MAX_LEVELS; ++curLevel)
+      other.head->setNext(curLevel, static_cast<DataNode*>(other.tail));
+    other.tail->setPrev(static_cast<DataNode*>(other.head));
+    other.staleIndex();
+    other.staleLookups();
+    staleLookups(); //gained other's keys
+    other.height = 0;
+    other.numNodes = 0;
+    refreshLookups();
+  }
+
+  //Builds the result of a set operation by walking both maps in step and appending copies
+  //of the entries to keep (with their original tower heights) to the end of a new map
+  template <typename Key_T, typename Mapped_T>
+  Map<Key_T, Mapped_T> Map<Key_T, Mapped_T>::combine(const Map &lhs, const Map &rhs, bool keepLhsOnly, bool keepBoth, bool keepRhsOnly) {
+    Map result;
+    result.promote();
+    result.copyOnWrite = lhs.copyOnWrite;
+    DataNode *last[MAX_LEVELS];
+    for (int curLevel = 0; curLevel < MAX_LEVELS; ++curLevel)
+      last[curLevel] = static_cast<DataNode*>(result.head);
+
+    //copies keep the tower height of their node (inline entries get a random one)
+    auto append = [&result, &last](const ConstIterator &it) {
+      int copyHeight = (it.cur != Link()) ? nodeHeight(it.node()) : result.randomHeight();
+      result.appendNode(makeNode(*it, copyHeight), copyHeight, last);
+    };
+    ConstIterator lhsTrav = lhs.begin();
+    ConstIterator rhsTrav = rhs.begin();
+    while (lhsTrav != lhs.end() || rhsTrav != rhs.end()) {
+      if (rhsTrav == rhs.end() || (lhsTrav != lhs.end() && lhsTrav->first < rhsTrav->first)) {
+	if (keepLhsOnly)
+	  append(lhsTrav);
+	++lhsTrav;
+      }
+      else if (lhsTrav == lhs.end() || rhsTrav->first < lhsTrav->first) {
+	if (keepRhsOnly)
+	  append(rhsTrav);
+	++rhsTrav;
+      }
+      else {
+	if (keepBoth)
+	  append(lhsTrav);
+	++lhsTrav;
+	++rhsTrav;
+      }
+    }
+    result.refreshLookups();
+    return result;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  Map<Key_T, Mapped_T> set_union(const Map<Key_T, Mapped_T> &lhs, const Map<Key_T, Mapped_T> &rhs) {
+    return Map<Key_T, Mapped_T>::combine(lhs, rhs, true, true, true);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  Map<Key_T, Mapped_T> set_intersection(const Map<Key_T, Mapped_T> &lhs, const Map<Key_T, Mapped_T> &rhs) {
+    return Map<Key_T, Mapped_T>::combine(lhs, rhs, false, true, false);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  Map<Key_T, Mapped_T> set_difference(const Map<Key_T, Mapped_T> &lhs, const Map<Key_T, Mapped_T> &rhs) {
+    return Map<Key_T, Mapped_T>::combine(lhs, rhs, true, false, false);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::newSentinels() {
+    staleIndex();
+    staleLookups();
+    numNodes = 0;
+    height = 0;
+    head = makeSentinel();
+    tail = makeSentinel();
+    for (int curLevel = 0; curLevel < MAX_LEVELS; ++curLevel)
+      head->setNext(curLevel, static_cast<DataNode*>(tail));
+    tail->setPrev(static_cast<DataNode*>(head));
+  }
+
+  //an empty map: inline if the traits allow it, otherwise a skip list with only its sentinels
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::startEmpty() {
+    if (INLINE_CAPACITY == 0) {
+      small = false;
+      newSentinels();
+      return;
+    }
+    small = true;
+    head = nullptr;
+    tail = nullptr;
+    numNodes = 0;
+    height = 0;
+  }
+
+  //Moves the inline entries into skip list nodes. Called when the map outgrows the array
+  //and before anything that only works on nodes. The map stays a skip list afterwards.
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::promote() {
+    if (!isSmall())
+      return;
+    small = false;
+    try {
+      newSentinels();
+      copyEntries(entries);
+    }
+    catch (...) {
+      freeSentinel(head);
+      freeSentinel(tail);
+      head = nullptr;
+      tail = nullptr;
+      small = true;
+      throw;
+    }
+    entries.clear();
+  }
+
+  //appends copies of src's entries to this (empty) skip list, with random tower heights
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::copyEntries(const InlineEntries &src) {
+    DataNode *last[MAX_LEVELS];
+    for (int curLevel = 0; curLevel < MAX_LEVELS; ++curLevel)
+      last[curLevel] = static_cast<DataNode*>(head);
+
+    try {
+      for (int slot = src.first(); slot != InlineEntries::NONE; slot = src.next(slot)) {
+	int newHeight = randomHeight();
+	appendNode(makeNode(src.value(slot), newHeight), newHeight, last);
+      }
+    }
+    catch (...) {
+      clear();
+      throw;
+    }
+    refreshLookups();
+  }
+
+  //Every map seeds its height generator from here rather than carrying (and reading) a
+  //std::random_device of its own
+  template <typename Key_T, typename Mapped_T>
+  unsigned Map<Key_T, Mapped_T>::newSeed() {
+    static thread_local std::mt19937 seeds(std::random_device{}());
+    return seeds();
+  }
+
+  //Clones the count nodes between srcHead and srcTail onto the end of this (empty) map
+  //with the same tower heights, in one linear pass. With COPY_THREADS other than 1, a large
+  //map is cut into one segment per thread instead, each thread clones and chains its
+  //segment, and the chains are stitched together.
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::copyNodes(const SentinelNode *srcHead, const SentinelNode *srcTail, size_t count) {
+    if (COPY_THREADS != 1 && count >= PARALLEL_MIN_SIZE) {
+      std::vector<DataNode*> bounds(1, srcHead->next(0));
+      cutNodes(srcHead, srcTail, threadCount(COPY_THREADS), bounds);
+      bounds.push_back(static_cast<DataNode*>(const_cast<SentinelNode*>(srcTail)));
+      size_t chunks = bounds.size() - 1;
+      std::vector<DataNode*> firsts(chunks * MAX_LEVELS, nullptr);
+      std::vector<DataNode*> lasts(chunks * MAX_LEVELS, nullptr);
+      std::vector<size_t> copied(chunks, 0);
+      uint64_t born = currentVersion();
+      try {
+	runChunks(chunks, [&](size_t c) {
+	  for (DataNode *trav = bounds[c]; trav != bounds[c + 1]; trav = trav->next(0)) {
+	    DataNode *newNode = makeNode(trav->value, nodeHeight(trav));
+	    newNode->stamp(born);
+	    chainNode(newNode, &firsts[c * MAX_LEVELS], &lasts[c * MAX_LEVELS]);
+	    ++copied[c];
+	  }
+	});
+      }
+      catch (...) {
+	for (size_t c = 0; c < chunks; ++c) {
+	  DataNode *trav = firsts[c * MAX_LEVELS];
+	  for (size_t left = copied[c]; left > 0; --left) { //copied[c] nodes made it onto chain c
+	    DataNode *next = trav->next(0);
+	    freeNode(trav);
+	    trav = next;
+	  }
+	}
+	throw;
+      }
+      stitchChains(firsts, lasts);
+      for (size_t c = 0; c < chunks; ++c)
+	numNodes += copied[c];
+      refreshLookups();
+      return;
+    }
+
+    DataNode *last[MAX_LEVELS];
+    for (int curLevel = 0; curLevel < MAX_LEVELS; ++curLevel)
+      last[curLevel] = static_cast<DataNode*>(head);
+
+    try {
+      DataNode *trav = srcHead->next(0);
+      while (trav != static_cast<const DataNode*>(srcTail)) {
+	appendNode(makeNode(trav->value, nodeHeight(trav)), nodeHeight(trav), last);
+	trav = trav->next(0);
+      }
+    }
+    catch (...) {
+      clear();
+      throw;
+    }
+    refreshLookups();
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::share(const Map &mapIn) {
+    if (mapIn.shareCount == nullptr)
+      mapIn.shareCount = new size_t(1);
+    ++*mapIn.shareCount;
+    shareCount = mapIn.shareCount;
+    staleIndex();
+    staleLookups();
+    head = mapIn.head;
+    tail = mapIn.tail;
+    numNodes = mapIn.numNodes;
+    height = mapIn.height;
+  }
+
+  //Called before anything that may modify the nodes: takes a private clone if they are
+  //still shared with other copy-on-write copies
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::detach() {
+    if (shareCount == nullptr)
+      return;
+    if (*shareCount == 1) { //everyone else has detached already
+      delete shareCount;
+      shareCount = nullptr;
+      return;
+    }
+
+    SentinelNode *sharedHead = head;
+    SentinelNode *sharedTail = tail;
+    size_t sharedNodes = numNodes;
+    int sharedHeight = height;
+    size_t *sharedCount = shareCount;
+    shareCount = nullptr;
+    try {
+      newSentinels();
+      copyNodes(sharedHead, sharedTail, sharedNodes);
+    }
+    catch (...) {
+      if (head != sharedHead) {
+	freeSentinel(head);
+	freeSentinel(tail);
+      }
+      head = sharedHead;
+      tail = sharedTail;
+      numNodes = sharedNodes;
+      height = sharedHeight;
+      shareCount = sharedCount;
+      throw;
+    }
+    --*sharedCount;
+  }
+
+  //Drops this map's hold on its nodes, freeing them (and the sentinels) if no other map
+  //shares them. head and tail are left dangling.
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::release() {
+    freeVersions(); //no snapshots are open unless the nodes are our own
+    staleIndex();
+    staleLookups();
+    if (shareCount != nullptr) {
+      if (--*shareCount > 0) {
+	shareCount = nullptr;
+	return;
+      }
+      delete shareCount;
+      shareCount = nullptr;
+    }
+    clear();
+    freeSentinel(head);
+    freeSentinel(tail);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  template <bool Enabled>
+  typename Map<Key_T, Mapped_T>::Snapshot Map<Key_T, Mapped_T>::snapshot() {
+    static_assert(Enabled, "snapshot() needs MapTraits::snapshots");
+    promote();
+    detach(); //the versioned links have to be our own
+    if (versions == nullptr)
+      versions = new VersionLog;
+    //the snapshot sees everything stamped up to its version, later changes get a newer stamp
+    uint64_t version = versions->writeVersion++;
+    return Snapshot(this, version);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  bool Map<Key_T, Mapped_T>::snapshotsOpen() const {
+    return (SNAPSHOTS && versions != nullptr && !versions->open.empty());
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  uint64_t Map<Key_T, Mapped_T>::currentVersion() const {
+    return (versions != nullptr) ? versions->writeVersion : 0;
+  }
+
+  //All link changes in the live map go through here. If an open snapshot may traverse
+  //the node, the old target is pushed onto the node's history first (once per level and
+  //write version, since snapshots can't see the values in between).
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::setLink(SentinelNode *node, int level, DataNode *target) {
+    if (snapshotsOpen() && node->born() <= versions->open.back().first && node->next(level) != target) {
+      bool recorded = false;
+      for (LinkHistory *h = node->history(); h != nullptr && h->until == versions->writeVersion; h = h->older) {
+	if (h->level == level) {
+	  recorded = true;
+	  break;
+	}
+      }
+      if (!recorded) {
+	if (node->history() == nullptr)
+	  versions->withHistory.push_back(node);
+	*node->historyLink() = new LinkHistory{node->next(level), versions->writeVersion, level, node->history()};
+      }
+    }
+    node->setNext(level, target);
+    if (level == INDEX_LEVEL)
+      staleIndex();
+  }
+
+  //Frees a node that was unlinked from the live map, unless an open snapshot can still
+  //reach it (or it still has history, which closeSnapshot() will free along with it)
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::retireNode(DataNode *node) {
+    if (snapshotsOpen() && (node->born() <= versions->open.back().first || node->history() != nullptr))
+      versions->retired.push_back({node, versions->writeVersion});
+    else
+      freeNode(node);
+  }
+
+  //Before a writable reference to node's value is handed out, a node that open snapshots
+  //can see is replaced in the live map by a fresh copy, and the original stays with the snapshots
+  template <typename Key_T, typename Mapped_T>
+  typename Map<Key_T, Mapped_T>::DataNode *Map<Key_T, Mapped_T>::privateNode(DataNode *node) {
+    if (node == static_cast<DataNode*>(tail) || !snapshotsOpen() || node->born() > versions->open.back().first)
+      return node;
+
+    int copyHeight = nodeHeight(node);
+    DataNode *copy = makeNode(node->value, copyHeight);
+    copy->stamp(currentVersion());
+    DataNode *trav = static_cast<DataNode*>(head);
+    for (int curLevel = height - 1; curLevel >= 0; --curLevel) {
+      while (trav->next(curLevel) != node && trav->next(curLevel) != static_cast<DataNode*>(tail) &&
+	     trav->nextKey(curLevel) < node->key())
+	trav = trav->next(curLevel);
+      if (curLevel < copyHeight) {
+	copy->setNext(curLevel, node->next(curLevel));
+	copy->setSpan(curLevel, node->span(curLevel));
+	setLink(trav, curLevel, copy);
+      }
+    }
+    copy->setPrev(node->prevNode());
+    copy->next(0)->setPrev(copy);
+    if (hashFresh())
+      hashIndex->replace(hashKey(copy->key()), node, copy);
+    retireNode(node);
+    refreshLookups(); //copy took node's place on INDEX_LEVEL
+    return copy;
+  }
+
+  //a snapshot handle for version was created (or copied)
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::openSnapshot(uint64_t version) {
+    for (auto it = versions->open.rbegin(); it != versions->open.rend(); ++it) {
+      if (it->first == version) {
+	++it->second;
+	return;
+      }
+    }
+    versions->open.push_back({version, 1}); //only ever called with a new version from snapshot()
+  }
+
+  //A snapshot handle for version went away. Once the oldest open version moves forward,
+  //the history entries and retired nodes that no open snapshot can reach are freed.
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::closeSnapshot(uint64_t version) {
+    auto &open = versions->open;
+    size_t pos = 0;
+    while (open[pos].first != version)
+      ++pos;
+    if (--open[pos].second > 0)
+      return;
+    open.erase(open.begin() + pos);
+    if (pos != 0)
+      return;
+
+    uint64_t oldest = open.empty() ? std::numeric_limits<uint64_t>::max() : open.front().first;
+    size_t kept = 0;
+    for (SentinelNode *node : versions->withHistory) {
+      LinkHistory **link = node->historyLink();
+      while (*link != nullptr && (*link)->until > oldest)
+	link = &(*link)->older;
+      LinkHistory *h = *link;
+      *link = nullptr;
+      while (h != nullptr) {
+	LinkHistory *older = h->older;
+	delete h;
+	h = older;
+      }
+      if (node->history() != nullptr)
+	versions->withHistory[kept++] = node;
+    }
+    versions->withHistory.resize(kept);
+
+    kept = 0;
+    for (auto &retired : versions->retired) {
+      if (retired.second <= oldest)
+	freeNode(retired.first);
+      else
+	versions->retired[kept++] = retired;
+    }
+    versions->retired.resize(kept);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::freeVersions() {
+    if (versions == nullptr)
+      return;
+    for (SentinelNode *node : versions->withHistory) {
+      LinkHistory **link = node->historyLink();
+      while (*link != nullptr) {
+	LinkHistory *older = (*link)->older;
+	delete *link;
+	*link = older;
+      }
+    }
+    for (auto &retired : versions->retired)
+      freeNode(retired.first);
+    delete versions;
+    versions = nullptr;
+  }
+
+  //where node's link on level pointed at the time of snapshot version
+  template <typename Key_T, typename Mapped_T>
+  typename Map<Key_T, Mapped_T>::DataNode *Map<Key_T, Mapped_T>::linkAt(const SentinelNode *node, int level, uint64_t version) {
+    DataNode *next = node->next(level);
+    for (const LinkHistory *h = node->history(); h != nullptr && h->until > version; h = h->older) {
+      if (h->level == level)
+	next = h->next;
+    }
+    return next;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  int Map<Key_T, Mapped_T>::randomHeight() {
+    return randomHeight(e);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  int Map<Key_T, Mapped_T>::randomHeight(std::default_random_engine &engine) {
+    std::uniform_int_distribution<int> u(0,1);
+    int insertHeight = 1;
+    bool repeat = true;
+   
+    while (repeat && insertHeight < MAX_LEVELS) {
+      repeat = u(engine);
+      insertHeight++;
+    }
+    return insertHeight;
+  }
+
+  //a node is linked on every level of the tower it was allocated with
+  template <typename Key_T, typename Mapped_T>
+  int Map<Key_T, Mapped_T>::nodeHeight(const SentinelNode *node) {
+    return node->levels;
+  }
+
+  //alignment of every node and of the tower in front of it, and the unit NodeStore counts
+  //in with COMPRESSED_LINKS
+  template <typename Key_T, typename Mapped_T>
+  size_t Map<Key_T, Mapped_T>::nodeAlign() {
+    size_t align = std::max(alignof(DataNode), alignof(Link));
+    const size_t keyAlign = NextKeys<NEXT_KEYS>::KEY_ALIGN;
+    const size_t spanAlign = NodeSpans<SPAN_COUNTS>::SPAN_ALIGN;
+    return std::max(std::max(align, keyAlign), spanAlign);
+  }
+
+  //bytes in front of a node for a tower of the given height
+  template <typename Key_T, typename Mapped_T>
+  size_t Map<Key_T, Mapped_T>::towerBytes(int levels) {
+    const size_t align = nodeAlign();
+    return (NodeSpans<SPAN_COUNTS>::towerBytes(levels) + align - 1) / align * align;
+  }
+
+  //Memory for a node of nodeSize bytes with a tower of the given height in front of it.
+  //Returns where the node goes. NodeStore keeps one free list per tower height, so with
+  //COMPRESSED_LINKS head and tail take as much room as a DataNode.
+  template <typename Key_T, typename Mapped_T>
+  char *Map<Key_T, Mapped_T>::allocNode(int levels, size_t nodeSize) {
+    size_t bytes = towerBytes(levels) + (COMPRESSED_LINKS ? sizeof(DataNode) : nodeSize);
+    return Links::allocate(bytes, levels) + towerBytes(levels);
+  }
+
+  //a new node with room for nodeHeight links, which is all it can ever be linked on
+  template <typename Key_T, typename Mapped_T>
+  typename Map<Key_T, Mapped_T>::DataNode *Map<Key_T, Mapped_T>::makeNode(const ValueType &valueIn, int nodeHeight) {
+    char *mem = allocNode(nodeHeight, sizeof(DataNode));
+    try {
+      return new (mem) DataNode(valueIn, nodeHeight);
+    }
+    catch (...) {
+      Links::release(mem - towerBytes(nodeHeight), nodeHeight);
+      throw;
+    }
+  }
+
+  //destroys a node made by makeNode() and frees it with its tower (nothing for nullptr)
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::freeNode(DataNode *node) {
+    if (node == nullptr)
+      return;
+    int levels = node->levels;
+    node->~DataNode();
+    Links::release(reinterpret_cast<char*>(node) - towerBytes(levels), levels);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename Map<Key_T, Mapped_T>::SentinelNode *Map<Key_T, Mapped_T>::makeSentinel() {
+    return new (allocNode(MAX_LEVELS, sizeof(SentinelNode))) SentinelNode(MAX_LEVELS);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::freeSentinel(SentinelNode *node) {
+    node->~SentinelNode();
+    Links::release(reinterpret_cast<char*>(node) - towerBytes(MAX_LEVELS), MAX_LEVELS);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  template <typename Unused>
+  char *Map<Key_T, Mapped_T>::NodeStore<true, Unused>::base = nullptr;
+
+  template <typename Key_T, typename Mapped_T>
+  template <typename Unused>
+  std::mutex Map<Key_T, Mapped_T>::NodeStore<true, Unused>::lock;
+
+  template <typename Key_T, typename Mapped_T>
+  template <typename Unused>
+  size_t Map<Key_T, Mapped_T>::NodeStore<true, Unused>::used = 0;
+
+  template <typename Key_T, typename Mapped_T>
+  template <typename Unused>
+  uint32_t Map<Key_T, Mapped_T>::NodeStore<true, Unused>::freeBlocks[MAX_LEVELS + 1] = {};
+
+  //A block of bytes for a node with a tower of the given height: the last block freed for
+  //that height, or else the next units of the range, which the first call reserves
+  template <typename Key_T, typename Mapped_T>
+  template <typename Unused>
+  char *Map<Key_T, Mapped_T>::NodeStore<true, Unused>::allocate(size_t bytes, int levels) {
+    const size_t unit = nodeAlign();
+    const size_t units = size_t(1) << 32;
+    std::lock_guard<std::mutex> guard(lock);
+    if (freeBlocks[levels] != 0) {
+      char *mem = base + freeBlocks[levels] * unit;
+      freeBlocks[levels] = *reinterpret_cast<uint32_t*>(mem);
+      return mem;
+    }
+    if (base == nullptr) {
+      void *range = mmap(nullptr, units * unit, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (range == MAP_FAILED)
+	throw std::bad_alloc();
+      base = static_cast<char*>(range);
+      used = 1;
+    }
+    size_t need = (bytes + unit - 1) / unit;
+    if (need > units - used)
+      throw std::bad_alloc();
+    char *mem = base + used * unit;
+    used += need;
+    return mem;
+  }
+
+  //puts a block from allocate() on the free list for its tower height
+  template <typename Key_T, typename Mapped_T>
+  template <typename Unused>
+  void Map<Key_T, Mapped_T>::NodeStore<true, Unused>::release(char *mem, int levels) {
+    std::lock_guard<std::mutex> guard(lock);
+    *reinterpret_cast<uint32_t*>(mem) = freeBlocks[levels];
+    freeBlocks[levels] = static_cast<uint32_t>((mem - base) / nodeAlign());
+  }
+
+  //Links newNode in front of tail on its bottom nodeHeight levels. last[] holds the
+  //rightmost node on every level and is advanced here, so appending keys in ascending
+  //order builds the whole map in a single O(n) pass with no searching.
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::appendNode(DataNode *newNode, int nodeHeight, DataNode **last) {
+    newNode->stamp(currentVersion());
+    if (SPAN_COUNTS) { //last[] ends at tail, which newNode takes the place of
+      for (int curLevel = height; curLevel < nodeHeight; ++curLevel)
+	head->setSpan(curLevel, numNodes + 1);
+      for (int curLevel = nodeHeight; curLevel < height; ++curLevel)
+	last[curLevel]->setSpan(curLevel, last[curLevel]->span(curLevel) + 1);
+      for (int curLevel = 0; curLevel < nodeHeight; ++curLevel)
+	newNode->setSpan(curLevel, 1);
+    }
+    for (int curLevel = 0; curLevel < nodeHeight; ++curLevel) {
+      setLink(last[curLevel], curLevel, newNode);
+      newNode->setNext(curLevel, static_cast<DataNode*>(tail));
+      last[curLevel] = newNode;
+    }
+    newNode->setPrev(tail->prevNode());
+    tail->setPrev(newNode);
+    if (nodeHeight > height)
+      height = nodeHeight;
+    ++numNodes;
+    staleLookups();
+  }
+
+  //Like appendNode() for a node that is already in a map: links it behind last[] without
+  //touching its own links, which are overwritten when its successors are relinked (or by
+  //closeLevels()), so that snapshots record what they pointed to before.
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::relinkNode(DataNode *node, int nodeHeight, DataNode **last) {
+    node->setPrev(last[0]);
+    for (int curLevel = 0; curLevel < nodeHeight; ++curLevel) {
+      setLink(last[curLevel], curLevel, node);
+      last[curLevel] = node;
+    }
+  }
+
+  //ends every level after last[] at tail once relinkNode() has placed all the nodes, and
+  //counts the spans of the result
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::closeLevels(DataNode **last, int newHeight) {
+    for (int curLevel = 0; curLevel < MAX_LEVELS; ++curLevel) {
+      if (last[curLevel]->next(curLevel) != static_cast<DataNode*>(tail))
+	setLink(last[curLevel], curLevel, static_cast<DataNode*>(tail));
+    }
+    tail->setPrev(last[0]);
+    height = newHeight;
+    countSpans();
+  }
+
+  //counts every span from scratch, in one pass over level 0 (with SPAN_COUNTS)
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::countSpans() {
+    if (!SPAN_COUNTS)
+      return;
+    SentinelNode *last[MAX_LEVELS];
+    size_t lastPos[MAX_LEVELS];
+    for (int curLevel = 0; curLevel < height; ++curLevel) {
+      last[curLevel] = head;
+      lastPos[curLevel] = 0;
+    }
+    size_t pos = 0;
+    for (DataNode *trav = head->next(0); trav != static_cast<DataNode*>(tail); trav = trav->next(0)) {
+      ++pos;
+      for (int curLevel = 0; curLevel < nodeHeight(trav); ++curLevel) {
+	last[curLevel]->setSpan(curLevel, pos - lastPos[curLevel]);
+	last[curLevel] = trav;
+	lastPos[curLevel] = pos;
+      }
+    }
+    for (int curLevel = 0; curLevel < height; ++curLevel)
+      last[curLevel]->setSpan(curLevel, pos + 1 - lastPos[curLevel]);
+  }
+
+  //last[l] = the last node on level l (head if the level is empty), found by one
+  //descent that never drops down before the end of a level
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::lastNodes(DataNode **last) const {
+    DataNode *trav = static_cast<DataNode*>(head);
+    for (int curLevel = MAX_LEVELS - 1; curLevel >= 0; --curLevel) {
+      if (curLevel < height) {
+	while (trav->next(curLevel) != static_cast<DataNode*>(tail))
+	  trav = trav->next(curLevel);
+      }
+      last[curLevel] = trav;
+    }
+  }
+
+  //Nodes that come from another map carry its write versions. Moving our own clock up to
+  //at least that far keeps them older than (so visible to) any snapshot we take later.
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::adoptVersion(uint64_t version) {
+    if (!SNAPSHOTS || version <= currentVersion())
+      return;
+    if (versions == nullptr)
+      versions = new VersionLog;
+    versions->writeVersion = version;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  template <typename Serializer>
+  void Map<Key_T, Mapped_T>::save(std::ostream &os, bool withHeights, const Serializer &serializer) const {
+    ByteWriter out(os);
+    saveTo(out, withHeights, serializer);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  template <typename Serializer>
+  void Map<Key_T, Mapped_T>::save(int fd, bool withHeights, const Serializer &serializer) const {
+    ByteWriter out(fd);
+    saveTo(out, withHeights, serializer);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  template <typename Serializer>
+  void Map<Key_T, Mapped_T>::load(std::istream &is, const Serializer &serializer) {
+    ByteReader in(is);
+    loadFrom(in, serializer);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  template <typename Serializer>
+  void Map<Key_T, Mapped_T>::load(int fd, const Serializer &serializer) {
+    ByteReader in(fd);
+    loadFrom(in, serializer);
+  }
+
+  //header: magic, version, flags, sizeof(Key_T), sizeof(Mapped_T), entry count
+  //then one record per entry in key order: [height byte] key value
+  template <typename Key_T, typename Mapped_T>
+  template <typename Serializer>
+  void Map<Key_T, Mapped_T>::saveTo(ByteWriter &out, bool withHeights, const Serializer &serializer) const {
+    withHeights = withHeights && !isSmall(); //inline entries have no towers to keep
+    uint32_t header[5] = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, withHeights ? SNAPSHOT_HEIGHTS : 0,
+			  static_cast<uint32_t>(sizeof(Key_T)), static_cast<uint32_t>(sizeof(Mapped_T))};
+    uint64_t count = size();
+    out.write(header, sizeof(header));
+    out.write(&count, sizeof(count));
+
+    if (isSmall()) {
+      for (int slot = entries.first(); slot != InlineEntries::NONE; slot = entries.next(slot))
+	serializer.write(out, entries.value(slot));
+      out.flush();
+      return;
+    }
+    DataNode *trav = head->next(0);
+    while (trav != static_cast<DataNode*>(tail)) {
+      if (withHeights) {
+	uint8_t h = nodeHeight(trav);
+	out.write(&h, sizeof(h));
+      }
+      serializer.write(out, trav->value);
+      trav = trav->next(0);
+    }
+    out.flush();
+  }
+
+  //Replaces the contents of the map with a snapshot written by save(). Records arrive in
+  //key order, so every node is appended at the tail instead of being inserted.
+  template <typename Key_T, typename Mapped_T>
+  template <typename Serializer>
+  void Map<Key_T, Mapped_T>::loadFrom(ByteReader &in, const Serializer &serializer) {
+    uint32_t header[5];
+    uint64_t count;
+    in.read(header, sizeof(header));
+    in.read(&count, sizeof(count));
+    if (header[0] != SNAPSHOT_MAGIC)
+      throw std::runtime_error("not a map snapshot");
+    if (header[1] != SNAPSHOT_VERSION)
+      throw std::runtime_error("unsupported map snapshot version");
+    if (header[3] != sizeof(Key_T) || header[4] != sizeof(Mapped_T))
+      throw std::runtime_error("map snapshot was written for different key/value types");
+    bool withHeights = header[2] & SNAPSHOT_HEIGHTS;
+
+    clear();
+    promote(); //loaded entries are appended as nodes
+    DataNode *last[MAX_LEVELS];
+    for (int curLevel = 0; curLevel < MAX_LEVELS; ++curLevel)
+      last[curLevel] = static_cast<DataNode*>(head);
+
+    try {
+      for (uint64_t i = 0; i < count; ++i) {
+	int newHeight;
+	if (withHeights) {
+	  uint8_t h;
+	  in.read(&h, sizeof(h));
+	  if (h < 1 || h > MAX_LEVELS)
+	    throw std::runtime_error("corrupt tower height in map snapshot");
+	  newHeight = h;
+	}
+	else
+	  newHeight = randomHeight();
+
+	DataNode *newNode = makeNode(serializer.read(in), newHeight);
+	if (last[0] != static_cast<DataNode*>(head) && !(last[0]->key() < newNode->key())) {
+	  freeNode(newNode);
+	  throw std::runtime_error("map snapshot keys are not in ascending order");
+	}
+	appendNode(newNode, newHeight, last);
+      }
+    }
+    catch (...) {
+      clear();
+      throw;
+    }
+    refreshLookups();
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  void Map<Key_T, Mapped_T>::print() const {
+    DataNode *trav;
+    if (isSmall()) {
+      printf("numNodes=%lu, inline\n", size());
+      return;
+    }
+    printf("numNodes=%lu, height=%d\n", size(), height);
+    for(int i = height - 1; i >= 0; --i) {
+      printf("level %d:", i);
+      trav = head->next(i);
+      while (trav != static_cast<DataNode*>(tail)) {
+	printf("-->{%d, %d}", trav->value.first, trav->value.second);
+	trav = trav->next(i);
+      }
+      printf("\n");
+    }
+    printf("reverse level 0:");
+    trav = LINK_PREV ? tail->prevNode() : static_cast<DataNode*>(head);
+    while (trav != static_cast<DataNode*>(head)) {
+      printf("-->{%d, %d}", trav->value.first, trav->value.second);
+      trav = trav->prevNode();
     }
     printf("\n**************************\n");
   }
@@ -597,110 +3683,230 @@ namespace cs540 {
 
   template<typename Key_T, typename Mapped_T>
   typename Map<Key_T, Mapped_T>::Iterator &Map<Key_T, Mapped_T>::Iterator::operator++() {
-    cur = cur->nextNodes[0];
+    if (INLINE_CAPACITY > 0 && entries != nullptr)
+      slot = entries->next(slot);
+    else
+      cur = node()->link(0);
     return *this;
   }
-  
+
   template<typename Key_T, typename Mapped_T>
   typename Map<Key_T, Mapped_T>::Iterator Map<Key_T, Mapped_T>::Iterator::operator++(int) {
-    auto tmp = cur;
-    cur = cur->nextNodes[0];
+    Iterator tmp = *this;
+    ++*this;
     return tmp;
   }
 
   template<typename Key_T, typename Mapped_T>
   typename Map<Key_T, Mapped_T>::Iterator &Map<Key_T, Mapped_T>::Iterator::operator--() {
-    cur = cur->prev;
+    static_assert(LINK_PREV, "Iterator::operator-- needs MapTraits::reverseIteration");
+    if (INLINE_CAPACITY > 0 && entries != nullptr)
+      slot = (slot == InlineEntries::NONE) ? entries->last() : entries->prev(slot);
+    else
+      cur = node()->prevLink();
     return *this;
   }
 
   template<typename Key_T, typename Mapped_T>
   typename Map<Key_T, Mapped_T>::Iterator Map<Key_T, Mapped_T>::Iterator::operator--(int) {
-    auto tmp = cur;
-    cur = cur->prev;
+    Iterator tmp = *this;
+    --*this;
     return tmp;
   }
 
   template<typename Key_T, typename Mapped_T>
-  typename Map<Key_T, Mapped_T>::ValueType &Map<Key_T, Mapped_T>::Iterator::operator* () const {
-    return cur->value;
+  typename Map<Key_T, Mapped_T>::ValueType &Map<Key_T, Mapped_T>::Iterator::operator*() const {
+    if (INLINE_CAPACITY > 0 && entries != nullptr)
+      return entries->value(slot);
+    return node()->value;
   }
 
   template<typename Key_T, typename Mapped_T>
   typename Map<Key_T, Mapped_T>::ValueType *Map<Key_T, Mapped_T>::Iterator::operator->() const {
-    return &cur->value;
+    return &**this;
   }
 
   template<typename Key_T, typename Mapped_T>
   typename Map<Key_T, Mapped_T>::ConstIterator &Map<Key_T, Mapped_T>::ConstIterator::operator++() {
-    cur = cur->nextNodes[0];
+    if (INLINE_CAPACITY > 0 && entries != nullptr)
+      slot = entries->next(slot);
+    else
+      cur = node()->link(0);
     return *this;
   }
 
   template<typename Key_T, typename Mapped_T>
   typename Map<Key_T, Mapped_T>::ConstIterator Map<Key_T, Mapped_T>::ConstIterator::operator++(int) {
-    auto tmp = cur;
-    cur = cur->nextNodes[0];
+    ConstIterator tmp = *this;
+    ++*this;
     return tmp;
   }
 
   template<typename Key_T, typename Mapped_T>
   typename Map<Key_T, Mapped_T>::ConstIterator &Map<Key_T, Mapped_T>::ConstIterator::operator--() {
-    cur = cur->prev;
+    static_assert(LINK_PREV, "ConstIterator::operator-- needs MapTraits::reverseIteration");
+    if (INLINE_CAPACITY > 0 && entries != nullptr)
+      slot = (slot == InlineEntries::NONE) ? entries->last() : entries->prev(slot);
+    else
+      cur = node()->prevLink();
     return *this;
   }
 
   template<typename Key_T, typename Mapped_T>
   typename Map<Key_T, Mapped_T>::ConstIterator Map<Key_T, Mapped_T>::ConstIterator::operator--(int) {
-    auto tmp = cur;
-    cur = cur->prev;
+    ConstIterator tmp = *this;
+    --*this;
     return tmp;
   }
 
   template<typename Key_T, typename Mapped_T>
   const typename Map<Key_T, Mapped_T>::ValueType &Map<Key_T, Mapped_T>::ConstIterator::operator*() const {
-    return cur->value;
+    if (INLINE_CAPACITY > 0 && entries != nullptr)
+      return entries->value(slot);
+    return node()->value;
   }
 
   template<typename Key_T, typename Mapped_T>
   const typename Map<Key_T, Mapped_T>::ValueType *Map<Key_T, Mapped_T>::ConstIterator::operator->() const {
-    return &cur->value;
+    return &**this;
   }
 
   template<typename Key_T, typename Mapped_T>
   typename Map<Key_T, Mapped_T>::ReverseIterator &Map<Key_T, Mapped_T>::ReverseIterator::operator++() {
-    cur = cur->prev;
+    if (INLINE_CAPACITY > 0 && entries != nullptr)
+      slot = entries->prev(slot);
+    else
+      cur = node()->prevLink();
     return *this;
   }
 
   template<typename Key_T, typename Mapped_T>
   typename Map<Key_T, Mapped_T>::ReverseIterator Map<Key_T, Mapped_T>::ReverseIterator::operator++(int) {
-    auto tmp = cur;
-    cur = cur->prev;
+    ReverseIterator tmp = *this;
+    ++*this;
     return tmp;
   }
 
   template<typename Key_T, typename Mapped_T>
   typename Map<Key_T, Mapped_T>::ReverseIterator &Map<Key_T, Mapped_T>::ReverseIterator::operator--() {
-    cur = cur->nextNodes[0];
+    if (INLINE_CAPACITY > 0 && entries != nullptr)
+      slot = (slot == InlineEntries::NONE) ? entries->first() : entries->next(slot);
+    else
+      cur = node()->link(0);
     return *this;
   }
 
   template<typename Key_T, typename Mapped_T>
   typename Map<Key_T, Mapped_T>::ReverseIterator Map<Key_T, Mapped_T>::ReverseIterator::operator--(int) {
-    auto tmp = cur;
-    cur = cur->nextNodes[0];
+    ReverseIterator tmp = *this;
+    --*this;
     return tmp;
   }
 
   template<typename Key_T, typename Mapped_T>
   typename Map<Key_T, Mapped_T>::ValueType &Map<Key_T, Mapped_T>::ReverseIterator::operator*() const {
-    return cur->value;
+    if (INLINE_CAPACITY > 0 && entries != nullptr)
+      return entries->value(slot);
+    return node()->value;
   }
 
   template<typename Key_T, typename Mapped_T>
   typename Map<Key_T, Mapped_T>::ValueType *Map<Key_T, Mapped_T>::ReverseIterator::operator->() const {
+    return &**this;
+  }
+
+  template<typename Key_T, typename Mapped_T>
+  Map<Key_T, Mapped_T>::Snapshot::Snapshot(Map *mapIn, uint64_t versionIn) : map(mapIn), version(versionIn), numNodes(mapIn->size()), height(mapIn->height) {
+    map->openSnapshot(version);
+  }
+
+  template<typename Key_T, typename Mapped_T>
+  Map<Key_T, Mapped_T>::Snapshot::Snapshot(const Snapshot &snapIn) : map(snapIn.map), version(snapIn.version), numNodes(snapIn.numNodes), height(snapIn.height) {
+    map->openSnapshot(version);
+  }
+
+  template<typename Key_T, typename Mapped_T>
+  typename Map<Key_T, Mapped_T>::Snapshot &Map<Key_T, Mapped_T>::Snapshot::operator=(const Snapshot &snapIn) {
+    snapIn.map->openSnapshot(snapIn.version);
+    map->closeSnapshot(version);
+    map = snapIn.map;
+    version = snapIn.version;
+    numNodes = snapIn.numNodes;
+    height = snapIn.height;
+    return *this;
+  }
+
+  template<typename Key_T, typename Mapped_T>
+  Map<Key_T, Mapped_T>::Snapshot::~Snapshot() {
+    map->closeSnapshot(version);
+  }
+
+  template<typename Key_T, typename Mapped_T>
+  size_t Map<Key_T, Mapped_T>::Snapshot::size() const {
+    return numNodes;
+  }
+
+  template<typename Key_T, typename Mapped_T>
+  bool Map<Key_T, Mapped_T>::Snapshot::empty() const {
+    return (numNodes == 0);
+  }
+
+  template<typename Key_T, typename Mapped_T>
+  typename Map<Key_T, Mapped_T>::Snapshot::ConstIterator Map<Key_T, Mapped_T>::Snapshot::begin() const {
+    return ConstIterator(linkAt(map->head, 0, version), version);
+  }
+
+  template<typename Key_T, typename Mapped_T>
+  typename Map<Key_T, Mapped_T>::Snapshot::ConstIterator Map<Key_T, Mapped_T>::Snapshot::end() const {
+    return ConstIterator(static_cast<DataNode*>(map->tail), version);
+  }
+
+  //same descent as Map::find(), following the links as they were at the snapshot's version
+  template<typename Key_T, typename Mapped_T>
+  typename Map<Key_T, Mapped_T>::Snapshot::ConstIterator Map<Key_T, Mapped_T>::Snapshot::find(const Key_T &keyIn) const {
+    DataNode *tailNode = static_cast<DataNode*>(map->tail);
+    const SentinelNode *trav = map->head;
+    for (int curLevel = height - 1; curLevel >= 0; --curLevel) {
+      DataNode *next = linkAt(trav, curLevel, version);
+      while (next != tailNode && next->key() < keyIn) {
+	trav = next;
+	next = linkAt(trav, curLevel, version);
+      }
+      if (next != tailNode && next->key() == keyIn)
+	return ConstIterator(next, version);
+    }
+    return end();
+  }
+
+  template<typename Key_T, typename Mapped_T>
+  const Mapped_T &Map<Key_T, Mapped_T>::Snapshot::at(const Key_T &keyIn) const {
+    auto retIt = find(keyIn);
+    if (retIt == end())
+      throw std::out_of_range("value not found while using at()");
+    return retIt->second;
+  }
+
+  template<typename Key_T, typename Mapped_T>
+  typename Map<Key_T, Mapped_T>::Snapshot::ConstIterator &Map<Key_T, Mapped_T>::Snapshot::ConstIterator::operator++() {
+    cur = linkAt(cur, 0, version);
+    return *this;
+  }
+
+  template<typename Key_T, typename Mapped_T>
+  typename Map<Key_T, Mapped_T>::Snapshot::ConstIterator Map<Key_T, Mapped_T>::Snapshot::ConstIterator::operator++(int) {
+    auto tmp = *this;
+    cur = linkAt(cur, 0, version);
+    return tmp;
+  }
+
+  template<typename Key_T, typename Mapped_T>
+  const typename Map<Key_T, Mapped_T>::ValueType &Map<Key_T, Mapped_T>::Snapshot::ConstIterator::operator*() const {
+    return cur->value;
+  }
+
+  template<typename Key_T, typename Mapped_T>
+  const typename Map<Key_T, Mapped_T>::ValueType *Map<Key_T, Mapped_T>::Snapshot::ConstIterator::operator->() const {
     return &cur->value;
   }
 } //end namespace cs540
-#endif
+#endif
\ No newline at end of file
@@ -0,0 +1,176 @@
+#ifndef AWILLI64_MAPPEDMAP_HPP
+#define AWILLI64_MAPPEDMAP_HPP
+
+#include "FrozenMap.hpp"
+
+#include <string>      //temporary file name in write()
+#include <cstdio>      //std::rename
+#include <fcntl.h>     //open
+#include <sys/mman.h>  //mmap/munmap
+#include <sys/stat.h>  //fstat
+
+namespace cs540 {
+  //Read-only map that runs lookups directly on the pages of a file written by
+  //MappedMap::write(). Opening only validates the header and maps the file, so it takes
+  //the same time for any table size, and every process that opens the same file shares
+  //one copy of it through the page cache. The file holds the FrozenMap layout (Eytzinger
+  //ordered keys and a parallel value array), so keys and values have to be trivially
+  //copyable and the file is only readable on machines with the same ABI.
+  template <typename Key_T, typename Mapped_T>
+  class MappedMap : public FrozenView<Key_T, Mapped_T> {
+    static_assert(std::is_trivially_copyable<Key_T>::value && std::is_trivially_copyable<Mapped_T>::value,
+		  "MappedMap needs trivially copyable keys and values");
+  public:
+    //Constructors and Assignment Operator
+    explicit MappedMap (const char *path);
+    MappedMap          (MappedMap &&);
+    MappedMap          (const MappedMap &) = delete;
+    MappedMap          &operator= (const MappedMap &) = delete;
+    ~MappedMap         ();
+    //************************************
+
+    //writes mapIn to path (through a temporary file that is renamed into place, so
+    //readers never see a half written table)
+    static void write (const Map<Key_T, Mapped_T> &mapIn, const char *path);
+
+  private:
+    typedef typename FrozenView<Key_T, Mapped_T>::StoredKey StoredKey;
+    typedef FrozenView<Key_T, Mapped_T> View;
+
+    //fixed size file header, the key and value arrays follow at cache line aligned offsets
+    struct Header {
+      uint32_t magic;
+      uint32_t version;
+      uint32_t keySize;
+      uint32_t keyAlign;
+      uint32_t mappedSize;
+      uint32_t mappedAlign;
+      uint64_t count;
+      uint64_t keysOffset;
+      uint64_t valuesOffset;
+      uint64_t fileSize;
+    };
+
+    static const uint32_t FILE_MAGIC   = 0x4d303435; //"540M"
+    static const uint32_t FILE_VERSION = 0x10001;    //distinct from Map::save() snapshots
+    static const uint64_t ALIGNMENT    = 64;
+
+    static uint64_t alignUp    (uint64_t offset);
+    static Header   makeHeader (uint64_t count);
+
+    void   *base;
+    size_t length;
+  }; //end class MappedMap
+
+  template <typename Key_T, typename Mapped_T>
+  uint64_t MappedMap<Key_T, Mapped_T>::alignUp(uint64_t offset) {
+    return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  typename MappedMap<Key_T, Mapped_T>::Header MappedMap<Key_T, Mapped_T>::makeHeader(uint64_t count) {
+    Header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = FILE_MAGIC;
+    header.version = FILE_VERSION;
+    header.keySize = sizeof(StoredKey);
+    header.keyAlign = alignof(StoredKey);
+    header.mappedSize = sizeof(Mapped_T);
+    header.mappedAlign = alignof(Mapped_T);
+    header.count = count;
+    header.keysOffset = alignUp(sizeof(Header));
+    header.valuesOffset = alignUp(header.keysOffset + (count + 1) * sizeof(StoredKey));
+    header.fileSize = header.valuesOffset + (count + 1) * sizeof(Mapped_T);
+    return header;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  void MappedMap<Key_T, Mapped_T>::write(const Map<Key_T, Mapped_T> &mapIn, const char *path) {
+    Header header = makeHeader(mapIn.size());
+    std::string tmpPath = std::string(path) + ".tmp";
+
+    int fd = ::open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+      throw std::runtime_error("could not create mapped map file");
+    if (ftruncate(fd, header.fileSize) != 0) {
+      ::close(fd);
+      ::unlink(tmpPath.c_str());
+      throw std::runtime_error("could not size mapped map file");
+    }
+    void *mem = mmap(nullptr, header.fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mem == MAP_FAILED) {
+      ::unlink(tmpPath.c_str());
+      throw std::runtime_error("could not map mapped map file for writing");
+    }
+
+    //the map is walked in key order, which is the in-order walk of the Eytzinger slots
+    char *bytes = static_cast<char*>(mem);
+    memcpy(bytes, &header, sizeof(header));
+    StoredKey *keys = reinterpret_cast<StoredKey*>(bytes + header.keysOffset);
+    Mapped_T *values = reinterpret_cast<Mapped_T*>(bytes + header.valuesOffset);
+    size_t slot = View::firstSlot(header.count);
+    for (auto it = mapIn.begin(); it != mapIn.end(); ++it) {
+      memcpy(&keys[slot], &it->first, sizeof(StoredKey));
+      memcpy(&values[slot], &it->second, sizeof(Mapped_T));
+      slot = View::nextSlot(slot, header.count);
+    }
+
+    bool synced = (msync(mem, header.fileSize, MS_SYNC) == 0);
+    munmap(mem, header.fileSize);
+    if (!synced || std::rename(tmpPath.c_str(), path) != 0) {
+      ::unlink(tmpPath.c_str());
+      throw std::runtime_error("could not write mapped map file");
+    }
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  MappedMap<Key_T, Mapped_T>::MappedMap(const char *path) : base(nullptr), length(0) {
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("could not open mapped map file");
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < sizeof(Header)) {
+      ::close(fd);
+      throw std::runtime_error("mapped map file is too short");
+    }
+    void *mem = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mem == MAP_FAILED)
+      throw std::runtime_error("could not map mapped map file");
+
+    Header header;
+    memcpy(&header, mem, sizeof(header));
+    Header expected = makeHeader(header.count);
+    if (header.magic != FILE_MAGIC || header.version != FILE_VERSION ||
+	header.keySize != expected.keySize || header.keyAlign != expected.keyAlign ||
+	header.mappedSize != expected.mappedSize || header.mappedAlign != expected.mappedAlign ||
+	header.keysOffset != expected.keysOffset || header.valuesOffset != expected.valuesOffset ||
+	header.fileSize != expected.fileSize || header.fileSize > static_cast<uint64_t>(st.st_size)) {
+      munmap(mem, st.st_size);
+      throw std::runtime_error("not a mapped map file for these key/value types");
+    }
+
+    base = mem;
+    length = st.st_size;
+    this->numKeys = header.count;
+    this->keys = reinterpret_cast<const StoredKey*>(static_cast<const char*>(mem) + header.keysOffset);
+    this->values = reinterpret_cast<const Mapped_T*>(static_cast<const char*>(mem) + header.valuesOffset);
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  MappedMap<Key_T, Mapped_T>::MappedMap(MappedMap &&mapIn) : View(mapIn), base(mapIn.base), length(mapIn.length) {
+    mapIn.base = nullptr;
+    mapIn.length = 0;
+    mapIn.numKeys = 0;
+    mapIn.keys = nullptr;
+    mapIn.values = nullptr;
+  }
+
+  template <typename Key_T, typename Mapped_T>
+  MappedMap<Key_T, Mapped_T>::~MappedMap() {
+    if (base != nullptr)
+      munmap(base, length);
+  }
+} //end namespace cs540
+#endif
@@ -0,0 +1,77 @@
+#ifndef AWILLI64_STATICMAP_HPP
+#define AWILLI64_STATICMAP_HPP
+
+#include <cstddef>     //size_t
+#include <stdexcept>   //std::out_of_range in at()
+#include <utility>     //std::pair entries
+
+namespace cs540 {
+  //Fixed lookup table that is built entirely at compile time: a constexpr StaticMap is
+  //plain static data, so it costs nothing at startup, never allocates, and a lookup is a
+  //binary search over one array (folded away completely when the key is a constant).
+  //It is an aggregate, initialized like
+  //  constexpr StaticMap<char, const char*, 2> table {{ {'a', "x"}, {'b', "y"} }};
+  //The entries have to be listed in ascending key order, which
+  //  static_assert(table.sorted(), "...");
+  //checks (a short initializer list fails it too, the missing entries are zeroed).
+  //Key_T and Mapped_T have to be literal types, e.g. const char* rather than std::string.
+  template <typename Key_T, typename Mapped_T, size_t N>
+  struct StaticMap {
+    typedef std::pair<Key_T, Mapped_T> ValueType;
+    typedef const ValueType *ConstIterator;
+
+    //Size
+    constexpr size_t size  () const { return N; }
+    constexpr bool   empty () const { return (N == 0); }
+    //************************************
+
+    //Iterators
+    constexpr ConstIterator begin () const { return entries; }
+    constexpr ConstIterator end   () const { return entries + N; }
+    //************************************
+
+    //Element Access
+    constexpr ConstIterator find (const Key_T &keyIn) const {
+      return matchAt(lowerIndex(keyIn, 0, N), keyIn);
+    }
+
+    constexpr const Mapped_T &at (const Key_T &keyIn) const {
+      return (find(keyIn) != end()) ? find(keyIn)->second
+	: throw std::out_of_range("value not found while using at()");
+    }
+
+    constexpr bool contains (const Key_T &keyIn) const {
+      return (find(keyIn) != end());
+    }
+
+    //nullptr instead of an exception for a missing key
+    constexpr const Mapped_T *get_if (const Key_T &keyIn) const {
+      return (find(keyIn) != end()) ? &find(keyIn)->second : nullptr;
+    }
+
+    constexpr ConstIterator lower_bound (const Key_T &keyIn) const {
+      return entries + lowerIndex(keyIn, 0, N);
+    }
+
+    constexpr bool sorted (size_t from = 1) const {
+      return (from >= N) || (entries[from - 1].first < entries[from].first && sorted(from + 1));
+    }
+    //************************************
+
+    //public so that the map is an aggregate (constexpr constructors can't loop in C++11)
+    ValueType entries[N];
+
+  private:
+    //C++11 constexpr functions are a single return statement, so the binary search recurses
+    constexpr size_t lowerIndex (const Key_T &keyIn, size_t lo, size_t hi) const {
+      return (lo == hi) ? lo
+	: (entries[lo + (hi - lo) / 2].first < keyIn) ? lowerIndex(keyIn, lo + (hi - lo) / 2 + 1, hi)
+	: lowerIndex(keyIn, lo, lo + (hi - lo) / 2);
+    }
+
+    constexpr ConstIterator matchAt (size_t index, const Key_T &keyIn) const {
+      return (index < N && entries[index].first == keyIn) ? entries + index : end();
+    }
+  }; //end struct StaticMap
+} //end namespace cs540
+#endif
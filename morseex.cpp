@@ -1,15 +1,13 @@
-#include "Map.hpp"
+#include "StaticMap.hpp"
 
 #include <iostream>
 #include <string>
-#include <stdexcept>
 #include <cctype>
 
-
-cs540::Map<char, std::string> morse {
+// built at compile time: no static initialization and no heap, entries in key order
+constexpr cs540::StaticMap<char, const char*, 39> morse {{
     {',', "--..--"},
     {'.', ".-.-.-"},
-    {'?', "..--.."},
     {'0', "----- "},
     {'1', ".---- "},
     {'2', "..--- "},
@@ -20,6 +18,7 @@ cs540::Map<char, std::string> morse {
     {'7', "--... "},
     {'8', "---.. "},
     {'9', "----. "},
+    {'?', "..--.."},
     {'A', ".-"},
     {'B', "-..."},
     {'C', "-.-."},
@@ -46,7 +45,8 @@ cs540::Map<char, std::string> morse {
     {'X', "-..-"},
     {'Y', "-.--"},
     {'Z', "--.."},
-};
+}};
+static_assert(morse.sorted(), "morse table must be in key order");
 
 
 int main() {
@@ -55,9 +55,10 @@ int main() {
     std::string message;
     while(std::cin >> message) {
         for (auto c : message) {
-            try {
-                std::cout << morse.at(toupper(c)) << '\n';
-            } catch (std::out_of_range) {
+            const char *const *code = morse.get_if(toupper(c));
+            if (code != nullptr) {
+                std::cout << *code << '\n';
+            } else {
                 std::cout << "invalid character: " << c << '\n';
             }
         }
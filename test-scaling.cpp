@@ -8,11 +8,30 @@
 #include <map>
 #include <initializer_list>
 #include <set>
+#include <vector>
+#include <thread>
+#include <string>
 
 //Enables iteration test on a map larger than the memory available to the remote cluster
 //WARNING: This will be VERY slow.
 #define DO_BIG_ITERATION_TEST 0
 
+//Enables hardware performance counters (cycles, cache/TLB misses, ...) for every timed operation.
+//Linux only. Counters that the kernel or the machine doesn't allow are silently skipped.
+//Off by default; build with -DDO_PERF_COUNTERS=1 to turn them on.
+#ifndef DO_PERF_COUNTERS
+#define DO_PERF_COUNTERS 0
+#endif
+
+#if DO_PERF_COUNTERS && defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#include <cstdint>
+#endif
+
 namespace cs540 {
   template <typename K, typename V>
   class StdMapWrapper {
@@ -215,6 +234,115 @@ namespace cs540 {
   
 }
 
+//Wraps a set of perf_event_open counters around a timed section and reports them normalized per operation.
+//Each event is opened as its own (ungrouped) counter so that one unsupported event doesn't take the others down
+//with it; multiplexed counts are scaled by time_enabled/time_running.
+class PerfCounters {
+public:
+  PerfCounters() {
+#if DO_PERF_COUNTERS && defined(__linux__)
+    add("cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    add("instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    add("L1d-misses",    PERF_TYPE_HW_CACHE, cacheConfig(PERF_COUNT_HW_CACHE_L1D));
+    add("LLC-misses",    PERF_TYPE_HW_CACHE, cacheConfig(PERF_COUNT_HW_CACHE_LL));
+    add("branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    add("dTLB-misses",   PERF_TYPE_HW_CACHE, cacheConfig(PERF_COUNT_HW_CACHE_DTLB));
+    if (counters.empty())
+      std::cout << "(hardware performance counters unavailable, check /proc/sys/kernel/perf_event_paranoid)" << std::endl;
+#endif
+  }
+
+  ~PerfCounters() {
+#if DO_PERF_COUNTERS && defined(__linux__)
+    for (auto &c : counters)
+      close(c.fd);
+#endif
+  }
+
+  PerfCounters(const PerfCounters &) = delete;
+  PerfCounters &operator=(const PerfCounters &) = delete;
+
+  void start() {
+#if DO_PERF_COUNTERS && defined(__linux__)
+    for (auto &c : counters) {
+      ioctl(c.fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(c.fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  }
+
+  void stop() {
+#if DO_PERF_COUNTERS && defined(__linux__)
+    for (auto &c : counters)
+      ioctl(c.fd, PERF_EVENT_IOC_DISABLE, 0);
+    for (auto &c : counters) {
+      uint64_t buf[3] = {0, 0, 0}; //value, time_enabled, time_running
+      c.value = 0;
+      if (read(c.fd, buf, sizeof(buf)) == sizeof(buf) && buf[2] != 0)
+        c.value = double(buf[0]) * double(buf[1]) / double(buf[2]);
+    }
+#endif
+  }
+
+  //prints the counts from the last start()/stop() pair divided by numOps
+  void print(double numOps) const {
+#if DO_PERF_COUNTERS && defined(__linux__)
+    if (counters.empty() || numOps <= 0)
+      return;
+    std::cout << "    per op:";
+    double cycles = -1, instructions = -1;
+    for (auto &c : counters) {
+      std::cout << " " << c.name << "=" << c.value / numOps;
+      if (c.name == "cycles")
+        cycles = c.value;
+      else if (c.name == "instructions")
+        instructions = c.value;
+    }
+    if (cycles > 0 && instructions >= 0)
+      std::cout << " IPC=" << instructions / cycles;
+    std::cout << std::endl;
+#else
+    (void)numOps;
+#endif
+  }
+
+private:
+#if DO_PERF_COUNTERS && defined(__linux__)
+  struct Counter {
+    std::string name;
+    int fd;
+    double value;
+  };
+
+  static uint64_t cacheConfig(uint64_t cache) {
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  }
+
+  void add(const char *name, uint32_t type, uint64_t config) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    int fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd >= 0)
+      counters.push_back({name, fd, 0});
+  }
+
+  std::vector<Counter> counters;
+#endif
+};
+
+//shared by all of the tests below
+PerfCounters &perf() {
+  static PerfCounters counters;
+  return counters;
+}
+
 using Milli = std::chrono::duration<double, std::ratio<1,1000>>;
 using TimePoint = std::chrono::time_point<std::chrono::system_clock>;
 
@@ -228,17 +356,21 @@ template <typename T>
 T ascendingInsert(int count, bool print = true) {
   using namespace std::chrono;
   TimePoint start, end;
+  perf().start();
   start = system_clock::now();
   T map; 
   for(int i = 0; i < count; i++) {
     map.insert(std::pair<int, int>(i,i));
   }
   end = system_clock::now();
+  perf().stop();
   
   Milli elapsed = end - start;
   
-  if(print)
+  if(print) {
     std::cout << "Inserting " << count << " elements in aescending order took " << elapsed.count() << " milliseconds" << std::endl;
+    perf().print(count);
+  }
   
   return map;
 }
@@ -247,17 +379,21 @@ template <typename T>
 T descendingInsert(int count, bool print = true) {
   using namespace std::chrono;
   TimePoint start, end;
+  perf().start();
   start = system_clock::now();
   T map; 
   for(int i = count; i > 0; i--) {
     map.insert(std::pair<int, int>(i,i));
   }
   end = system_clock::now();
+  perf().stop();
   
   Milli elapsed = end - start;
   
-  if(print)
+  if(print) {
     std::cout << "Inserting " << count << " elements in descending order took " << elapsed.count() << " milliseconds" << std::endl;
+    perf().print(count);
+  }
   return map;
 }
 
@@ -275,14 +411,18 @@ void deleteTest() {
     toDelete.insert(i);
   }
   
+  perf().start();
+  
   start = system_clock::now();
   for(const int e : toDelete)
     m1.erase(e);
   end = system_clock::now();
+  perf().stop();
   
   Milli elapsed1 = end - start;
   
   std::cout << "deleting 10000 elements from a map of size 10000 took " << elapsed1.count() << " milliseconds" << std::endl;
+  perf().print(10000);
   
   {
     toDelete.clear();
@@ -293,14 +433,18 @@ void deleteTest() {
     }
   }
   
+  perf().start();
+  
   start = system_clock::now();
   for(const int e : toDelete)
     m2.erase(e);
   end = system_clock::now();
+  perf().stop();
   
   Milli elapsed2 = end - start;
   
   std::cout << "deleting 10000 elements from a map of size 100000 took " << elapsed2.count() << " milliseconds" << std::endl;
+  perf().print(10000);
   
   {
     toDelete.clear();
@@ -311,14 +455,18 @@ void deleteTest() {
     }
   }
   
+  perf().start();
+  
   start = system_clock::now();
   for(const int e : toDelete)
     m3.erase(e);
   end = system_clock::now();
+  perf().stop();
   
   Milli elapsed3 = end - start;
   
   std::cout << "deleting 10000 elements from a map of size 1000000 took " << elapsed3.count() << " milliseconds" << std::endl;
+  perf().print(10000);
   
   {
     toDelete.clear();
@@ -329,14 +477,18 @@ void deleteTest() {
     }
   }
   
+  perf().start();
+  
   start = system_clock::now();
   for(const int e : toDelete)
     m4.erase(e);
   end = system_clock::now();
+  perf().stop();
   
   Milli elapsed4 = end - start;
   
   std::cout << "deleting 10000 elements from a map of size 10000000 took " << elapsed4.count() << " milliseconds" << std::endl;
+  perf().print(10000);
 }
 
 template <typename T>
@@ -357,16 +509,20 @@ void findTest() {
     toFind.push_back(i);
   }
   
+  perf().start();
+  
   start = system_clock::now();
   for(const int e : toFind) {
     auto it = m1.find(e);
     m11.insert(*it);
   }
   end = system_clock::now();
+  perf().stop();
   
   Milli elapsed1 = end - start;
   
   std::cout << "Finding 10000 elements from a map of size " << m1.size() << " took " << elapsed1.count() << " milliseconds" << std::endl;
+  perf().print(10000);
   
   {
     toFind.clear();
@@ -377,16 +533,20 @@ void findTest() {
     }
   }
   
+  perf().start();
+  
   start = system_clock::now();
   for(const int e : toFind) {
     auto it = m2.find(e);
     m22.insert(*it);
   }
   end = system_clock::now();
+  perf().stop();
   
   Milli elapsed2 = end - start;
   
   std::cout << "Finding 10000 elements from a map of size " << m2.size() << " took " << elapsed2.count() << " milliseconds" << std::endl;
+  perf().print(10000);
   
   {
     toFind.clear();
@@ -397,16 +557,20 @@ void findTest() {
     }
   }
   
+  perf().start();
+  
   start = system_clock::now();
   for(const int e : toFind) {
     auto it = m3.find(e);
     m33.insert(*it);
   }
   end = system_clock::now();
+  perf().stop();
   
   Milli elapsed3 = end - start;
   
   std::cout << "Finding 10000 elements from a map of size " << m3.size() << " took " << elapsed3.count() << " milliseconds" << std::endl;
+  perf().print(10000);
   
   {
     toFind.clear();
@@ -417,16 +581,20 @@ void findTest() {
     }
   }
   
+  perf().start();
+  
   start = system_clock::now();
   for(const int e : toFind) {
     auto it = m4.find(e);
     m44.insert(*it);
   }
   end = system_clock::now();
+  perf().stop();
   
   Milli elapsed4 = end - start;
   
   std::cout << "Finding 10000 elements from a map of size " << m4.size() << " took " << elapsed4.count() << " milliseconds" << std::endl;
+  perf().print(10000);
   
 }
 
@@ -438,17 +606,45 @@ void iterationTest(int count) {
   TimePoint start, end;
   
   for(int j = 0; j < 3; j++) {
+    perf().start();
     start = system_clock::now();
     for(auto it = m.begin(); it != m.end(); it++) {
       if(j==2)
         (*it).second += j;
     }
     end = system_clock::now();
+    perf().stop();
   }
   
   Milli elapsed = end - start;
   
   std::cout << "Iterating across " << count << " elements in a map of size " << count << " took " << elapsed.count() << " milliseconds time per iteration was " << elapsed.count()/double(count)*1e6 << " nanoseconds" << std::endl;
+  perf().print(count);
+}
+
+//The same walk as iterationTest, split at upper level nodes across one thread per core
+template <typename T>
+void parallelIterationTest(int count) {
+  using namespace std::chrono;
+  T m = ascendingInsert<T>(count,false);
+  
+  TimePoint start, end;
+  
+  for(int j = 0; j < 3; j++) {
+    perf().start();
+    start = system_clock::now();
+    m.parallel_for_each([j](std::pair<const int, int> &kv) {
+      if(j==2)
+        kv.second += j;
+    });
+    end = system_clock::now();
+    perf().stop();
+  }
+  
+  Milli elapsed = end - start;
+  
+  std::cout << "Iterating across " << count << " elements on " << std::thread::hardware_concurrency() << " threads took " << elapsed.count() << " milliseconds time per iteration was " << elapsed.count()/double(count)*1e6 << " nanoseconds" << std::endl;
+  perf().print(count);
 }
 
 template <typename T>
@@ -458,13 +654,49 @@ void copyTest(int count) {
   
   TimePoint start, end;
   
+  perf().start();
+  
   start = system_clock::now();
   T m2(m);
   end = system_clock::now();
+  perf().stop();
 
   Milli elapsed = end - start;
   
   std::cout << "Copy construction of a map of size " << m2.size() << " took " << elapsed.count() << " milliseconds" << std::endl;
+  perf().print(count);
+}
+
+//Copy-on-write copies are free until one side is modified, which then pays for the clone
+template <typename T>
+void cowCopyTest(int count) {
+  using namespace std::chrono;
+  T m = ascendingInsert<T>(count,false);
+  m.setCopyOnWrite(true);
+  
+  TimePoint start, end;
+  
+  perf().start();
+  start = system_clock::now();
+  T m2(m);
+  end = system_clock::now();
+  perf().stop();
+
+  Milli elapsed = end - start;
+  
+  std::cout << "Copy-on-write copy of a map of size " << m2.size() << " took " << elapsed.count() << " milliseconds" << std::endl;
+  perf().print(1);
+
+  perf().start();
+  start = system_clock::now();
+  m2[count] = count;
+  end = system_clock::now();
+  perf().stop();
+
+  elapsed = end - start;
+  
+  std::cout << "First insert into the copy took " << elapsed.count() << " milliseconds" << std::endl;
+  perf().print(count);
 }
 
 
@@ -578,6 +810,9 @@ int main() {
     iterationTest<cs540::Map<int,int>>(1280000);
     iterationTest<cs540::Map<int,int>>(2560000);
     iterationTest<cs540::Map<int,int>>(5120000);
+    dispTestName("Parallel iteration test", m);
+    parallelIterationTest<cs540::Map<int,int>>(640000);
+    parallelIterationTest<cs540::Map<int,int>>(5120000);
 #if DO_BIG_ITERATION_TEST
     //Optional test. This is more ram than the remote machines have and will likely take a long time to run.
     iterationTest<cs540::Map<int,int>>(600000000);
@@ -605,6 +840,11 @@ int main() {
     copyTest<cs540::Map<int,int>>(100000);
     copyTest<cs540::Map<int,int>>(1000000);
     copyTest<cs540::Map<int,int>>(10000000);
+    dispTestName("Copy-on-write copy test", m);
+    cowCopyTest<cs540::Map<int,int>>(10000);
+    cowCopyTest<cs540::Map<int,int>>(100000);
+    cowCopyTest<cs540::Map<int,int>>(1000000);
+    cowCopyTest<cs540::Map<int,int>>(10000000);
     dispTestName("Copy test", w);
     copyTest<cs540::StdMapWrapper<int,int>>(10000);
     copyTest<cs540::StdMapWrapper<int,int>>(100000);
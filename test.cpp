@@ -1,4 +1,9 @@
 #include "Map.hpp"
+#include "FrozenMap.hpp"
+#include "MappedMap.hpp"
+#include "StaticMap.hpp"
+#include "DenseMap.hpp"
+#include "BufferedMap.hpp"
 
 #include <iostream>
 #include <string>
@@ -8,6 +13,92 @@
 #include <chrono>
 #include <iterator>
 #include <cassert>
+#include <sstream>
+#include <cstdint>
+#include <vector>
+
+// large values that are kept out of the skip list nodes
+struct Record {
+    int id;
+    char payload[500];
+};
+
+// maps keyed by short keep up to 8 entries inline, maps keyed by double cache next keys,
+// Records are stored apart from their nodes, Map<int, char> only iterates forward, maps
+// keyed by long keep a Bloom filter, Map<std::string, double> a hash index,
+// Map<int, std::string> copies and clears large maps on every core,
+// Map<uint64_t, int> and Map<int, long long> keep a key index, Map<int, int>,
+// Map<std::string, int> and the double/string maps allow snapshots,
+// Map<long long, std::string> stores its links compressed, and Map<unsigned, int> counts
+// link spans
+namespace cs540 {
+    template <>
+    struct MapTraits<short, std::string> : DefaultMapTraits {
+        static const size_t inlineCapacity = 8;
+    };
+
+    template <>
+    struct MapTraits<double, std::string> : DefaultMapTraits {
+        static const bool cacheNextKeys = true;
+        static const bool snapshots = true;
+    };
+
+    template <>
+    struct MapTraits<int, Record> : DefaultMapTraits {
+        static const bool separateValues = true;
+    };
+
+    template <>
+    struct MapTraits<int, char> : DefaultMapTraits {
+        static const bool reverseIteration = false;
+    };
+
+    template <>
+    struct MapTraits<long, int> : DefaultMapTraits {
+        static const bool bloomFilter = true;
+    };
+
+    template <>
+    struct MapTraits<std::string, double> : DefaultMapTraits {
+        static const bool hashIndex = true;
+        static const bool snapshots = true;
+    };
+
+    template <>
+    struct MapTraits<int, std::string> : DefaultMapTraits {
+        static const unsigned copyThreads = 0;
+    };
+
+    template <>
+    struct MapTraits<uint64_t, int> : DefaultMapTraits {
+        static const bool keyIndex = true;
+    };
+
+    template <>
+    struct MapTraits<int, long long> : DefaultMapTraits {
+        static const bool keyIndex = true;
+    };
+
+    template <>
+    struct MapTraits<int, int> : DefaultMapTraits {
+        static const bool snapshots = true;
+    };
+
+    template <>
+    struct MapTraits<long long, std::string> : DefaultMapTraits {
+        static const bool compressedLinks = true;
+    };
+
+    template <>
+    struct MapTraits<std::string, int> : DefaultMapTraits {
+        static const bool snapshots = true;
+    };
+
+    template <>
+    struct MapTraits<unsigned, int> : DefaultMapTraits {
+        static const bool spanCounts = true;
+    };
+}
 
 void stress(int stress_size) {
     auto seed = std::chrono::system_clock::now().time_since_epoch().count();
@@ -109,6 +200,1020 @@ cs540::Map<int, int> cubes(int low, int high) {
 }
 
 
+// writes the string length followed by its characters
+struct StringValueSerializer {
+    void write(cs540::ByteWriter &out, const std::pair<const int, std::string> &v) const {
+        uint32_t len = v.second.size();
+        out.write(&v.first, sizeof(v.first));
+        out.write(&len, sizeof(len));
+        out.write(v.second.data(), len);
+    }
+
+    std::pair<const int, std::string> read(cs540::ByteReader &in) const {
+        int key;
+        uint32_t len;
+        in.read(&key, sizeof(key));
+        in.read(&len, sizeof(len));
+        std::string str(len, '\0');
+        in.read(&str[0], len);
+        return {key, str};
+    }
+};
+
+void save_and_load() {
+    cs540::Map<int, double> m;
+    for (int i = 0; i < 5000; ++i) {
+        m.insert({(i * 7919) % 5000, i / 2.0});
+    }
+
+    for (bool withHeights : {false, true}) {
+        std::stringstream ss;
+        m.save(ss, withHeights);
+        cs540::Map<int, double> loaded{{-1, -1.0}}; // load() replaces the old contents
+        loaded.load(ss);
+        assert(loaded == m);
+        assert(loaded.find(-1) == std::end(loaded));
+        loaded.insert({-1, 0.0}); // still a working skip list
+        loaded.erase(4999);
+        assert(loaded.size() == m.size());
+    }
+
+    cs540::Map<int, std::string> words{{3, "three"}, {1, "one"}, {2, ""}};
+    std::stringstream ss;
+    words.save(ss, false, StringValueSerializer());
+    cs540::Map<int, std::string> words_loaded;
+    words_loaded.load(ss, StringValueSerializer());
+    assert(words_loaded == words);
+
+    std::stringstream garbage("definitely not a map");
+    bool thrown = false;
+    try {
+        words_loaded.load(garbage, StringValueSerializer());
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+}
+
+void bounds_and_freeze() {
+    cs540::Map<int, int> m;
+    for (int i = 0; i < 1000; i += 2) {
+        m.insert({i, -i});
+    }
+    assert(m.lower_bound(10)->first == 10);
+    assert(m.lower_bound(11)->first == 12);
+    assert(m.upper_bound(10)->first == 12);
+    assert(m.lower_bound(999) == std::end(m));
+    assert(m.lower_bound(-5) == std::begin(m));
+
+    for (int count : {0, 1, 2, 3, 7, 8, 500}) {
+        cs540::Map<int, int> src;
+        for (int i = 0; i < count; ++i) {
+            src.insert({2 * i, -i});
+        }
+        auto frozen = cs540::freeze(src);
+        assert(frozen.size() == src.size());
+
+        // iteration visits the keys in order, in both directions
+        auto it = src.begin();
+        for (auto fit = frozen.begin(); fit != frozen.end(); ++fit, ++it) {
+            assert(fit->first == it->first && (*fit).second == it->second);
+        }
+        assert(it == src.end());
+        auto rit = src.rbegin();
+        for (auto frit = frozen.rbegin(); frit != frozen.rend(); ++frit, ++rit) {
+            assert(frit->first == rit->first);
+        }
+        if (count > 0) {
+            assert((--frozen.end())->first == 2 * (count - 1));
+        }
+
+        for (int k = -1; k <= 2 * count; ++k) {
+            auto fit = frozen.find(k);
+            if (k >= 0 && k % 2 == 0 && k < 2 * count) {
+                assert(fit != frozen.end() && frozen.at(k) == -k / 2);
+            } else {
+                assert(fit == frozen.end());
+            }
+            auto lb = frozen.lower_bound(k);
+            auto mlb = src.lower_bound(k);
+            assert((lb == frozen.end()) == (mlb == src.end()));
+            if (mlb != src.end()) {
+                assert(lb->first == mlb->first);
+            }
+            auto ub = frozen.upper_bound(k);
+            auto mub = src.upper_bound(k);
+            assert((ub == frozen.end()) == (mub == src.end()));
+            if (mub != src.end()) {
+                assert(ub->first == mub->first);
+            }
+        }
+
+        cs540::FrozenMap<int, int> copy(frozen);
+        assert(copy.size() == frozen.size());
+    }
+
+    const cs540::Map<std::string, int> strings{{"b", 2}, {"a", 1}, {"c", 3}};
+    auto frozen_strings = cs540::freeze(strings);
+    assert(frozen_strings.at("b") == 2);
+    bool thrown = false;
+    try {
+        frozen_strings.at("d");
+    } catch (const std::out_of_range &) {
+        thrown = true;
+    }
+    assert(thrown);
+}
+
+void mapped_file() {
+    const char *path = "/tmp/cs540_mapped_map_test.bin";
+    cs540::Map<int, double> m;
+    for (int i = 0; i < 10000; ++i) {
+        m.insert({i * 3, i / 4.0});
+    }
+    cs540::MappedMap<int, double>::write(m, path);
+
+    {
+        cs540::MappedMap<int, double> mapped(path);
+        assert(mapped.size() == m.size());
+        assert(mapped.at(300) == 25.0);
+        assert(mapped.find(301) == mapped.end());
+        assert(mapped.lower_bound(301)->first == 303);
+        auto it = m.begin();
+        for (auto mit = mapped.begin(); mit != mapped.end(); ++mit, ++it) {
+            assert(mit->first == it->first && mit->second == it->second);
+        }
+
+        cs540::MappedMap<int, double> moved(std::move(mapped));
+        assert(moved.at(3) == 0.25 && mapped.empty());
+    }
+
+    bool thrown = false;
+    try {
+        cs540::MappedMap<long, double> wrong_types(path);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+    unlink(path);
+}
+
+void copy_on_write() {
+    cs540::Map<int, int> m;
+    m.setCopyOnWrite(true);
+    for (int i = 0; i < 100; ++i) {
+        m.insert({i, i});
+    }
+
+    cs540::Map<int, int> copy(m);
+    cs540::Map<int, int> assigned;
+    assigned = m;
+    assert(copy.isShared() && assigned.isShared() && m.isShared());
+    assert(copy == m && assigned == m);
+
+    // const access doesn't unshare
+    const auto &copy_ref = copy;
+    assert(copy_ref.at(5) == 5 && copy_ref.find(200) == copy_ref.end());
+    assert(copy.isShared());
+
+    // the first modification clones, the others keep sharing
+    copy[5] = 500;
+    assert(!copy.isShared() && m.isShared());
+    assert(copy.at(5) == 500 && m.at(5) == 5 && assigned.at(5) == 5);
+
+    m.erase(0);
+    assert(m.find(0) == m.end() && assigned.find(0) != assigned.end());
+    assert(!assigned.isShared()); // last one holding the original nodes
+
+    assigned.clear();
+    assert(assigned.empty() && m.size() == 99 && copy.size() == 100);
+
+    // copies of copies share too, and destroying them is fine in any order
+    auto *a = new cs540::Map<int, int>(m);
+    cs540::Map<int, int> b(*a);
+    delete a;
+    assert(b == m);
+    b.setCopyOnWrite(false);
+    cs540::Map<int, int> deep(b);
+    assert(!deep.isShared() && deep == b);
+}
+
+void snapshots() {
+    cs540::Map<int, int> m;
+    for (int i = 0; i < 10; ++i) {
+        m.insert({i, i});
+    }
+
+    auto snap = m.snapshot();
+    m.erase(3);
+    m.insert({42, 42});
+    m[5] = 500;
+    m.at(6) = 600;
+    auto later = m.snapshot();
+    m.clear();
+
+    // the first snapshot still sees the map as it was
+    assert(snap.size() == 10);
+    int expected = 0;
+    for (auto &kv : snap) {
+        assert(kv.first == expected && kv.second == expected);
+        ++expected;
+    }
+    assert(expected == 10);
+    assert(snap.at(3) == 3 && snap.find(42) == snap.end());
+
+    assert(later.size() == 10);
+    assert(later.at(5) == 500 && later.at(6) == 600 && later.at(42) == 42);
+    assert(later.find(3) == later.end());
+
+    assert(m.empty() && m.begin() == m.end());
+    m.insert({1, -1});
+    auto copy = later; // handles are cheap to copy
+    assert(copy.at(1) == 1);
+}
+
+void merge_and_set_operations() {
+    cs540::Map<int, int> evens, threes;
+    for (int i = 0; i < 100; i += 2) {
+        evens.insert({i, i});
+    }
+    for (int i = 0; i < 100; i += 3) {
+        threes.insert({i, -i});
+    }
+
+    auto both = set_intersection(evens, threes);
+    auto either = cs540::set_union(evens, threes);
+    auto only_evens = cs540::set_difference(evens, threes);
+    assert(both.size() == 17 && either.size() == 67 && only_evens.size() == 33);
+    for (auto &kv : both) {
+        assert(kv.first % 6 == 0 && kv.second == kv.first); // values come from the first map
+    }
+    for (auto &kv : only_evens) {
+        assert(kv.first % 2 == 0 && kv.first % 3 != 0);
+    }
+
+    // merge moves the nodes over and leaves the keys we already had behind
+    cs540::Map<int, int> merged(evens);
+    {
+        auto snap = merged.snapshot();
+        merged.merge(threes);
+        assert(merged == either);
+        assert(threes.size() == 17 && threes.at(6) == -6);
+        assert(snap.size() == 50 && snap.find(3) == snap.end());
+    }
+    int prev = -1;
+    for (auto it = merged.rbegin(); it != merged.rend(); ++it) {
+        assert(prev == -1 || it->first < prev);
+        prev = it->first;
+    }
+
+    cs540::Map<int, int> moved(std::move(merged));
+    assert(moved == either && merged.empty());
+    merged = std::move(moved);
+    assert(merged == either && moved.empty());
+    moved.merge(cs540::Map<int, int>{{1000, 1}});
+    assert(moved.size() == 1 && moved.at(1000) == 1);
+}
+
+void split_and_join() {
+    cs540::Map<int, int> m;
+    for (int i = 0; i < 1000; ++i) {
+        m.insert({i, i});
+    }
+
+    auto upper = m.split(600);
+    assert(m.size() == 600 && upper.size() == 400);
+    assert(m.rbegin()->first == 599 && upper.begin()->first == 600);
+    assert(m.find(600) == m.end() && upper.at(999) == 999);
+    upper.insert({2000, 1});
+    m.erase(0);
+    assert(m.size() == 599 && upper.size() == 401);
+
+    auto top = upper.split(5000); // nothing above the last key
+    assert(top.empty() && upper.size() == 401);
+    auto all = m.split(-1);       // everything moves
+    assert(m.empty() && all.size() == 599);
+
+    // join works on either side, but only for disjoint key ranges
+    all.join(std::move(upper));
+    assert(all.size() == 1000 && upper.empty());
+    cs540::Map<int, int> low{{-5, 0}, {-1, 0}};
+    all.join(std::move(low));
+    assert(all.size() == 1002 && all.begin()->first == -5 && all.rbegin()->first == 2000);
+    bool thrown = false;
+    try {
+        all.join(cs540::Map<int, int>{{500, 0}});
+    } catch (std::invalid_argument &) {
+        thrown = true;
+    }
+    assert(thrown && all.size() == 1002);
+
+    int prev = -10;
+    for (auto &kv : all) {
+        assert(kv.first > prev);
+        prev = kv.first;
+    }
+    for (int i = 1; i < 1000; ++i) {
+        assert(all.at(i) == i);
+    }
+}
+
+// with span counts split() sizes the halves from its search path, so they have to stay
+// right through every kind of change
+void span_counts() {
+    cs540::Map<unsigned, int> m;
+    for (unsigned i = 0; i < 4000; ++i) {
+        m.insert({i * 2, 0});
+    }
+    for (unsigned i = 0; i < 4000; i += 3) {
+        m.erase(i * 2);
+    }
+    std::vector<std::pair<unsigned, int>> odd;
+    for (unsigned i = 1; i < 2000; i += 2) {
+        odd.push_back({i, 1});
+    }
+    cs540::Map<unsigned, int> built;
+    built.build(odd.begin(), odd.end(), 4);
+    m.merge(built);
+    m.insert_sorted_batch(odd.begin(), odd.end()); // already there
+    auto nh = m.extract(2);
+    nh.key() = 9001;
+    m.insert(std::move(nh));
+    assert(m.size() == 2666 + 1000);
+
+    auto count = [](cs540::Map<unsigned, int>::Iterator it, cs540::Map<unsigned, int>::Iterator end) {
+        size_t n = 0;
+        for (; it != end; ++it) {
+            ++n;
+        }
+        return n;
+    };
+    for (unsigned key = 0; key < 9100; key += 97) {
+        size_t below = count(m.begin(), m.lower_bound(key));
+        auto upper = m.split(key);
+        assert(m.size() == below && upper.size() == 3666 - below);
+        assert(count(upper.begin(), upper.end()) == upper.size());
+        if (key % 2) {
+            m.join(std::move(upper));
+        } else {
+            upper.join(std::move(m));
+            m = std::move(upper);
+        }
+    }
+    cs540::Map<unsigned, int> copy(m);
+    auto upper = copy.split(4000);
+    assert(copy.size() == count(m.begin(), m.find(4000)) && upper.size() == 3666 - copy.size());
+    auto both = set_union(copy, cs540::Map<unsigned, int>{{3, 0}, {4001, 0}});
+    assert(both.split(4001).size() == 1 && both.size() == copy.size());
+}
+
+// moves every node of a map to another one and back through node handles
+template <typename K>
+void move_nodes() {
+    cs540::Map<K, std::string> from, to;
+    for (int i = 0; i < 5000; ++i) {
+        from.insert({K(i * 7 % 5000), std::to_string(i * 7 % 5000)}); // towers of every height
+    }
+    for (int i = 0; i < 5000; i += 2) {
+        auto node = from.extract(K(i));
+        const std::string *addr = &node.mapped();
+        auto result = to.insert(std::move(node));
+        assert(result.inserted && &result.position->second == addr);
+    }
+    while (!from.empty()) {
+        assert(to.insert(from.extract(from.begin())).inserted);
+    }
+    int expected = 0;
+    for (auto &kv : to) {
+        assert(kv.first == K(expected) && kv.second == std::to_string(expected));
+        ++expected;
+    }
+    assert(expected == 5000 && to.size() == 5000);
+    for (auto rit = to.rbegin(); rit != to.rend(); ++rit) {
+        assert(rit->first == K(--expected));
+    }
+    for (int i = 4999; i >= 0; --i) {
+        from.insert(to.extract(--to.end()));
+    }
+    assert(to.empty() && from.size() == 5000 && from.find(K(1234))->second == "1234");
+    assert(from.upper_bound(K(0))->first == K(1) && (--from.end())->first == K(4999));
+}
+
+void node_handles() {
+    cs540::Map<std::string, int> active{{"a", 1}, {"b", 2}, {"c", 3}};
+    cs540::Map<std::string, int> retired;
+
+    auto node = active.extract("b");
+    assert(node && node.key() == "b" && node.mapped() == 2);
+    assert(active.size() == 2 && active.find("b") == active.end());
+    const std::string *addr = &node.key();
+    auto result = retired.insert(std::move(node));
+    assert(result.inserted && !result.node && result.position->first == "b");
+    assert(&result.position->first == addr); // the same node, not a copy
+
+    // the key can be changed while the node is out of any map
+    node = active.extract(active.find("a"));
+    node.key() = "z";
+    node.mapped() = 26;
+    active.insert(std::move(node));
+    assert(active.size() == 2 && active.at("z") == 26 && active.rbegin()->first == "z");
+
+    // extracting a missing key gives an empty handle, inserting it does nothing
+    assert(active.extract("q").empty());
+    assert(!active.insert(cs540::Map<std::string, int>::node_type()).inserted);
+
+    // a duplicate key leaves the node in the handle
+    retired.insert({"c", 0});
+    auto dup = retired.insert(active.extract("c"));
+    assert(!dup.inserted && dup.node.key() == "c" && dup.node.mapped() == 3);
+    assert(dup.position->second == 0 && active.size() == 1);
+
+    // snapshots keep seeing an extracted entry
+    auto snap = retired.snapshot();
+    auto moved = retired.extract("b");
+    assert(moved.mapped() == 2 && snap.at("b") == 2 && retired.find("b") == retired.end());
+    active.insert(std::move(moved));
+    assert(active.at("b") == 2);
+
+    move_nodes<unsigned>();
+    move_nodes<long long>(); // compressed links
+}
+
+void compressed_links() {
+    cs540::Map<long long, std::string> m;
+    for (int i = 0; i < 3000; ++i) {
+        m.insert({3 * i, std::to_string(i)});
+    }
+    for (int i = 0; i < 3000; i += 4) {
+        m.erase(3 * i);
+    }
+    assert(m.size() == 2250 && m.find(3)->second == "1" && m.find(0) == m.end());
+    assert(m.lower_bound(4)->first == 6 && m.upper_bound(6)->first == 9);
+    assert((--m.find(15))->first == 9 && m.rbegin()->first == 8997);
+
+    // copies, splits and joins relink the same kind of nodes
+    cs540::Map<long long, std::string> copy(m);
+    auto upper = copy.split(4503);
+    assert(copy.size() + upper.size() == 2250 && upper.begin()->first == 4503);
+    copy.join(std::move(upper));
+    assert(copy == m);
+    m.clear();
+    assert(m.empty() && copy.at(8997) == "2999");
+}
+
+void inline_entries() {
+    cs540::Map<short, std::string> m;
+    for (short i = 7; i >= 0; --i) {
+        m.insert({i, std::to_string(i)});
+    }
+    auto it = m.find(3);
+    m.erase(5);
+    m.insert({5, "five"});
+    assert(it->second == "3"); // inline entries don't move
+    assert(m.size() == 8 && m.lower_bound(4)->first == 4 && m.upper_bound(7) == m.end());
+    short expected = 7;
+    for (auto rit = m.rbegin(); rit != m.rend(); ++rit) {
+        assert(rit->first == expected--);
+    }
+
+    cs540::Map<short, std::string> copy(m);
+    copy.insert({100, "promoted"}); // the ninth entry moves everything into nodes
+    assert(copy.size() == 9 && m.size() == 8);
+    assert(copy.at(5) == "five" && copy.at(100) == "promoted");
+    assert(copy != m);
+    copy.erase(100);
+    assert(copy == m);
+
+    m.clear();
+    assert(m.empty() && m.begin() == m.end());
+    m[2] = "two";
+    assert(m.at(2) == "two" && m.size() == 1);
+}
+
+void static_map() {
+    constexpr cs540::StaticMap<int, const char*, 4> names {{
+        {1, "one"}, {2, "two"}, {3, "three"}, {10, "ten"},
+    }};
+    static_assert(names.sorted(), "entries must be in key order");
+    static_assert(names.find(3)->second[0] == 't', "lookups fold at compile time");
+    static_assert(names.find(4) == names.end() && names.lower_bound(4)->first == 10, "");
+    static_assert(names.size() == 4 && !names.empty(), "");
+
+    constexpr cs540::StaticMap<int, int, 3> unsorted {{ {2, 0}, {1, 0}, {3, 0} }};
+    static_assert(!unsorted.sorted(), "out of order entries are detected");
+
+    int key = 10;
+    assert(std::string(names.at(key)) == "ten");
+    bool thrown = false;
+    try {
+        names.at(5);
+    } catch (std::out_of_range &) {
+        thrown = true;
+    }
+    assert(thrown);
+    int total = 0;
+    for (auto &kv : names) {
+        total += kv.first;
+    }
+    assert(total == 16);
+}
+
+void dense_map() {
+    enum Color { RED, GREEN, BLUE, ALPHA };
+    cs540::DenseMap<Color, int, RED, ALPHA> channels {{BLUE, 3}, {RED, 1}};
+    assert(channels.size() == 2 && channels.at(RED) == 1);
+    channels[ALPHA] = 4;
+    assert(channels.begin()->first == RED && channels.rbegin()->first == ALPHA);
+    assert(channels.lower_bound(GREEN)->first == BLUE && channels.upper_bound(ALPHA) == channels.end());
+
+    cs540::DenseMap<unsigned char, int> bytes;
+    for (int i = 255; i >= 0; i -= 3) {
+        bytes.insert({static_cast<unsigned char>(i), i});
+    }
+    assert(bytes.size() == 86 && !bytes.insert({255, 0}).second);
+    int expected = 0;
+    for (auto &kv : bytes) {
+        assert(kv.first == expected && kv.second == expected);
+        expected += 3;
+    }
+    auto it = bytes.end();
+    --it;
+    assert(it->first == 255);
+    bytes.erase(it);
+    bytes.erase(0);
+    assert(bytes.begin()->first == 3 && bytes.rbegin()->first == 252);
+    assert(bytes.find(4) == bytes.end() && bytes.lower_bound(4)->first == 6);
+    bool thrown = false;
+    try {
+        bytes.erase(4);
+    } catch (std::out_of_range &) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    cs540::DenseMap<short, std::string, -100, 100> words;
+    words.insert({-100, "min"});
+    words.insert({100, "max"});
+    thrown = false;
+    try {
+        words.insert({101, "outside"});
+    } catch (std::out_of_range &) {
+        thrown = true;
+    }
+    assert(thrown);
+    cs540::DenseMap<short, std::string, -100, 100> copy(words);
+    assert(copy == words);
+    copy.erase(100);
+    assert(copy != words && copy < words);
+    copy = std::move(words);
+    assert(copy.size() == 2 && words.empty() && words.begin() == words.end());
+    copy.clear();
+    assert(copy.empty() && copy.find(-100) == copy.end());
+}
+
+void key_index() {
+    // big enough for the upper levels to be indexed
+    cs540::Map<uint64_t, int> m;
+    const uint64_t top = ~uint64_t(0);
+    for (int i = 0; i < 20000; ++i) {
+        m.insert({top - 2 * uint64_t(i), i});
+    }
+    assert(m.find(top - 4)->second == 2 && m.find(top - 3) == m.end());
+    assert(m.lower_bound(top - 3)->first == top - 2 && m.upper_bound(top - 4)->first == top - 2);
+    assert(m.lower_bound(0)->first == top - 39998 && m.upper_bound(top) == m.end());
+    for (int i = 0; i < 20000; i += 2) {
+        m.erase(top - 2 * uint64_t(i));
+    }
+    assert(m.size() == 10000 && m.find(top) == m.end() && m.find(top - 2)->second == 1);
+
+    cs540::Map<int, long long> n;
+    for (int i = -10000; i < 10000; ++i) {
+        n.insert({3 * i, i});
+    }
+    auto upper = n.split(0);
+    // split() leaves both halves indexed, so lookups only read and can run side by side
+    long long hits = n.parallel_reduce(0LL, [&upper](long long acc, const std::pair<const int, long long> &kv) { return acc + (upper.find(-kv.first) != upper.end()); },
+                                       [](long long lhs, long long rhs) { return lhs + rhs; }, 4);
+    assert(hits == 9999); // all but 30000
+    assert(n.find(-3)->second == -1 && n.find(3) == n.end());
+    assert(upper.find(3)->second == 1 && upper.lower_bound(-100)->first == 0);
+    n.join(std::move(upper));
+    for (int i = -10000; i < 9990; i += 7) {
+        assert(n.at(3 * i) == i && n.lower_bound(3 * i - 1)->first == 3 * i && n.upper_bound(3 * i)->first == 3 * i + 3);
+    }
+    n.clear();
+    assert(n.find(0) == n.end() && n.lower_bound(-5) == n.end());
+}
+
+void next_key_cache() {
+    cs540::Map<double, std::string> m;
+    for (int i = 0; i < 2000; ++i) {
+        m.insert({i / 4.0, std::to_string(i)});
+    }
+    for (int i = 0; i < 2000; i += 3) {
+        m.erase(i / 4.0);
+    }
+    assert(m.find(0.25)->second == "1" && m.find(0.75) == m.end());
+    assert(m.lower_bound(0.7)->first == 1.0 && m.upper_bound(1.0)->first == 1.25);
+    {
+        auto snap = m.snapshot();
+        m.at(0.5) = "half"; // swaps in a copy of the node
+        m.insert({0.75, "back"});
+        assert(snap.find(0.5)->second == "2" && snap.find(0.75) == snap.end());
+    }
+    assert(m.at(0.5) == "half" && m.at(0.75) == "back");
+    auto upper = m.split(250.0);
+    assert(m.find(250.0) == m.end() && upper.begin()->first == 250.0);
+    m.join(std::move(upper));
+    assert(m.find(250.25)->second == "1001" && m.size() == 1334);
+}
+
+void separate_values() {
+    cs540::Map<int, Record> m;
+    for (int i = 0; i < 1000; ++i) {
+        Record r;
+        r.id = i;
+        r.payload[0] = char('a' + i % 26);
+        m.insert({2 * i, r});
+    }
+    assert(m.at(10).id == 5 && m.at(10).payload[0] == 'f' && m.find(11) == m.end());
+    m[10].id = -5;
+    assert(m.lower_bound(9)->second.id == -5 && m.upper_bound(10)->first == 12);
+
+    auto handle = m.extract(10);
+    handle.key() = 11; // the node's copy of the key is refreshed when it goes back in
+    assert(m.insert(std::move(handle)).inserted);
+    assert(m.find(10) == m.end() && m.find(11)->second.id == -5);
+    auto it = m.find(8);
+    assert((++it)->first == 11 && (++it)->first == 12);
+
+    cs540::Map<int, Record> copy(m);
+    int count = 0;
+    for (auto &kv : copy) {
+        assert(kv.first == 11 || kv.second.id == kv.first / 2);
+        ++count;
+    }
+    assert(count == 1000);
+}
+
+void forward_only() {
+    cs540::Map<int, char> m;
+    for (int i = 0; i < 500; ++i) {
+        m.insert({i, char('a' + i % 26)});
+    }
+    m.erase(0);
+    m.erase(250);
+    assert(m.size() == 498 && m.begin()->first == 1 && m.find(250) == m.end());
+    auto upper = m.split(300);
+    assert(upper.begin()->first == 300 && m.size() == 298);
+    upper.join(std::move(m)); // finds the last key without prev links
+    assert(upper.size() == 498 && m.empty());
+    int expected = 1;
+    for (auto &kv : upper) {
+        assert(kv.first == expected);
+        expected += (expected == 249) ? 2 : 1;
+    }
+    assert(expected == 500);
+}
+
+void non_throwing_lookups() {
+    cs540::Map<int, int> m;
+    m.setCopyOnWrite(true);
+    for (int i = 0; i < 100; i += 2) {
+        m.insert({i, i * 10});
+    }
+    assert(m.contains(40) && !m.contains(41) && m.count(40) == 1 && m.count(41) == 0);
+    assert(*m.get_if(40) == 400 && m.get_if(41) == nullptr);
+    *m.get_if(40) = 4;
+    assert(m.at(40) == 4);
+    assert(m.erase(41, std::nothrow) == 0 && m.erase(40, std::nothrow) == 1 && !m.contains(40));
+
+    // misses on a shared map don't clone it
+    cs540::Map<int, int> copy(m);
+    assert(copy.get_if(41) == nullptr && copy.erase(41, std::nothrow) == 0);
+    bool thrown = false;
+    try {
+        copy.at(41);
+    } catch (const std::out_of_range &) {
+        thrown = true;
+    }
+    assert(thrown);
+    assert(copy.isShared() && m.isShared());
+    assert(copy.erase(42, std::nothrow) == 1 && !copy.isShared() && m.contains(42));
+
+    // small maps keep their entries inline
+    cs540::Map<short, std::string> small {{1, "one"}, {2, "two"}};
+    assert(*small.get_if(2) == "two" && small.get_if(3) == nullptr);
+    assert(small.erase(3, std::nothrow) == 0 && small.erase(1, std::nothrow) == 1 && small.size() == 1);
+
+    cs540::DenseMap<unsigned char, int> dense {{7, 70}};
+    assert(dense.contains(7) && dense.count(8) == 0 && *dense.get_if(7) == 70 && dense.get_if(8) == nullptr);
+    assert(dense.erase(8, std::nothrow) == 0 && dense.erase(7, std::nothrow) == 1 && dense.empty());
+
+    static constexpr cs540::StaticMap<int, int, 2> table {{ {1, 10}, {3, 30} }};
+    static_assert(table.contains(3) && !table.contains(2) && *table.get_if(1) == 10, "constexpr lookups");
+    assert(table.get_if(2) == nullptr);
+}
+
+void bloom_filter() {
+    cs540::Map<long, int> m;
+    for (long i = 0; i < 20000; i += 2) {
+        m.insert({i, int(i)});
+    }
+    for (long i = 0; i < 20000; ++i) {
+        assert(m.contains(i) == (i % 2 == 0));
+    }
+    assert(m.at(1000) == 1000 && m.erase(1001, std::nothrow) == 0 && m.size() == 10000);
+
+    // inserts past the filter's capacity, then erases most of the keys again
+    for (long i = 20000; i < 60000; i += 2) {
+        m.insert({i, int(i)});
+    }
+    for (long i = 0; i < 50000; i += 2) {
+        m.erase(i);
+    }
+    for (long i = 49990; i < 50010; ++i) {
+        assert(m.contains(i) == (i >= 50000 && i % 2 == 0));
+    }
+
+    // keys that arrive without insert() are found too
+    cs540::Map<long, int> low;
+    for (long i = 1; i < 4000; i += 2) {
+        low.insert({i, int(i)});
+    }
+    assert(!low.contains(50000));
+    low.merge(m);
+    // merge() leaves the filter built, so lookups only read it and can run side by side
+    long missing = low.parallel_reduce(0L, [&low](long acc, const std::pair<const long, int> &kv) { return acc + !low.contains(kv.first + 1); },
+                                       [](long lhs, long rhs) { return lhs + rhs; }, 4);
+    assert(missing == 7000);
+    assert(low.contains(50000) && low.contains(3999) && m.empty());
+    auto upper = low.split(40000);
+    assert(!low.contains(50000) && upper.contains(50000));
+    low.join(std::move(upper));
+    assert(low.contains(59998) && low.find(59999) == low.end());
+
+    low.setCopyOnWrite(true);
+    cs540::Map<long, int> copy(low);
+    assert(copy.contains(1) && !copy.contains(2) && copy.isShared());
+    low.clear();
+    assert(!low.contains(1) && copy.contains(1));
+}
+
+void hash_index() {
+    cs540::Map<std::string, double> m;
+    for (int i = 0; i < 5000; ++i) {
+        m.insert({"k" + std::to_string(i), i});
+    }
+    assert(m.at("k1234") == 1234 && m.find("k5000") == m.end() && !m.contains("k"));
+    m["k42"] = 4.2;
+    m["new"] = 1;
+    assert(m.size() == 5001 && m.at("k42") == 4.2 && m.at("new") == 1);
+    for (int i = 0; i < 5000; i += 2) {
+        m.erase("k" + std::to_string(i));
+    }
+    assert(!m.contains("k1000") && m.contains("k1001") && m.erase("k1000", std::nothrow) == 0);
+
+    // ordered access still goes through the skip list
+    assert(m.begin()->first == "k1" && m.lower_bound("k2")->first == "k2001");
+    assert((--m.end())->first == "new");
+
+    // a write behind a snapshot swaps in a copy of the node, which is what lookups find
+    {
+        auto snap = m.snapshot();
+        m.at("k1001") = -1;
+        assert(snap.find("k1001")->second == 1001 && m.find("k1001")->second == -1);
+    }
+
+    auto upper = m.split("k5");
+    assert(!m.contains("k5001") && upper.contains("k501") && !upper.contains("k1001"));
+    m.join(std::move(upper));
+    // join() leaves the index built, so lookups only read it and can run side by side
+    long found = m.parallel_reduce(0L, [&m](long acc, const std::pair<const std::string, double> &kv) { return acc + m.contains(kv.first + "x"); },
+                                   [](long lhs, long rhs) { return lhs + rhs; }, 4);
+    assert(found == 0);
+    assert(m.contains("k501") && m.size() == 2501);
+    m.clear();
+    assert(!m.contains("k501"));
+}
+
+void parallel_build() {
+    std::default_random_engine gen(540);
+    std::uniform_int_distribution<int> dist(0, 50000);
+    std::vector<std::pair<int, int>> input;
+    for (int i = 0; i < 100000; ++i) {
+        input.push_back({dist(gen), i});
+    }
+
+    cs540::Map<int, int> inserted;
+    inserted.insert(input.begin(), input.end()); // keeps the first entry of a repeated key
+    cs540::Map<int, int> built{{-1, -1}};
+    auto snap = built.snapshot();
+    built.build(input.begin(), input.end(), 4);
+    assert(built.size() == inserted.size() && built == inserted);
+    assert(snap.size() == 1 && snap.begin()->first == -1);
+    auto rit = built.rbegin();
+    for (auto it = inserted.rbegin(); it != inserted.rend(); ++it, ++rit) {
+        assert(rit->first == it->first);
+    }
+    built.insert({50001, 0});
+    built.erase(input[0].first);
+    assert(built.contains(50001) && !built.contains(input[0].first));
+
+    cs540::Map<int, int> single;
+    single.build(input.begin(), input.begin() + 10, 0);
+    assert(single.size() <= 10 && single.at(input[0].first) == 0);
+    single.build(input.end(), input.end());
+    assert(single.empty());
+
+    std::vector<std::pair<int, Record>> records(3);
+    records[0].first = 3;
+    records[1].first = 1;
+    records[2].first = 2;
+    records[1].second.id = 7;
+    cs540::Map<int, Record> separate;
+    separate.build(records.begin(), records.end(), 2);
+    assert(separate.begin()->first == 1 && separate.begin()->second.id == 7 && separate.size() == 3);
+}
+
+void parallel_scans() {
+    cs540::Map<int, int> m;
+    for (int i = 0; i < 100000; ++i) {
+        m.insert({i, 1});
+    }
+    auto ranges = m.partition(8);
+    assert(ranges.size() == 8 && ranges.front().first == m.begin() && ranges.back().second == m.end());
+    for (size_t r = 0; r < ranges.size(); ++r) {
+        assert(ranges[r].first != ranges[r].second);
+        if (r > 0) {
+            assert(ranges[r].first == ranges[r - 1].second);
+        }
+    }
+
+    m.parallel_for_each([](std::pair<const int, int> &kv) { kv.second = kv.first % 3; }, 4);
+    const auto &cm = m;
+    long long sum = cm.parallel_reduce(0LL, [](long long acc, const std::pair<const int, int> &kv) { return acc + kv.second; },
+                                       [](long long lhs, long long rhs) { return lhs + rhs; });
+    assert(sum == 99999);
+    const cs540::Map<int, char> letters {{1, 'a'}, {2, 'b'}, {3, 'c'}};
+    std::string keys = letters.parallel_reduce(std::string(),
+        [](std::string acc, const std::pair<const int, char> &kv) { return acc + kv.second; },
+        [](std::string lhs, const std::string &rhs) { return lhs + rhs; }, 3);
+    assert(keys == "abc"); // combined in key order
+
+    // fewer entries than ranges, inline entries and empty maps
+    cs540::Map<int, int> two {{1, 1}, {2, 2}};
+    assert(two.partition(8).size() == 2);
+    cs540::Map<short, std::string> small {{1, "a"}, {2, "b"}, {3, "c"}, {4, "d"}, {5, "e"}};
+    auto smallRanges = small.partition(2);
+    assert(smallRanges.size() == 2 && smallRanges[0].first == small.begin() && smallRanges[1].first->first == 3);
+    cs540::Map<int, int> empty;
+    assert(empty.partition(4).empty());
+
+    // partition(0) is one range in either mode, and empty maps run nothing
+    assert(two.partition(0).size() == 1 && two.partition(0)[0].second == two.end());
+    assert(small.partition(0).size() == 1 && small.partition(0)[0].second == small.end());
+    int calls = 0;
+    empty.parallel_for_each([&calls](std::pair<const int, int> &) { ++calls; }, 4);
+    assert(calls == 0 && empty.parallel_reduce(7, [](int acc, const std::pair<const int, int> &) { return acc + 1; },
+                                                [](int lhs, int rhs) { return lhs + rhs; }, 4) == 7);
+    cs540::Map<short, std::string> none;
+    assert(none.parallel_reduce(std::string("x"), [](std::string acc, const std::pair<const short, std::string> &kv) { return acc + kv.second; },
+                                [](std::string lhs, const std::string &rhs) { return lhs + rhs; }) == "x");
+}
+
+void parallel_copy_and_clear() {
+    // big enough to be copied and freed by several threads
+    cs540::Map<int, std::string> m;
+    for (int i = 0; i < 400000; ++i) {
+        m.insert({i, std::to_string(i)});
+    }
+    cs540::Map<int, std::string> copy(m);
+    assert(copy == m && copy.size() == 400000);
+    assert(copy.find(123456)->second == "123456" && copy.lower_bound(-1) == copy.begin());
+    assert((--copy.end())->first == 399999);
+    int expected = 399999;
+    for (auto it = copy.rbegin(); it != copy.rend(); ++it) {
+        assert(it->first == expected--);
+    }
+    assert(expected == -1);
+    copy.erase(200000);
+    copy.at(7) = "seven";
+    assert(m.at(7) == "7" && m.find(200000) != m.end());
+
+    cs540::Map<int, std::string> assigned;
+    assigned = copy;
+    assert(assigned == copy);
+    copy.clear();
+    assert(copy.empty() && copy.begin() == copy.end() && copy.find(7) == copy.end());
+    copy.insert({1, "one"});
+    assert(copy.size() == 1 && assigned.size() == 399999);
+}
+
+void sorted_batches() {
+    cs540::Map<int, int> m;
+    for (int i = 0; i < 10000; i += 2) {
+        m.insert({i, i});
+    }
+    std::vector<std::pair<int, int>> batch;
+    for (int i = -5; i < 12000; i += 3) {
+        batch.push_back({i, -1});
+    }
+    batch.push_back({11998, 7}); // a repeated key keeps its first value
+    size_t added = m.insert_sorted_batch(batch.begin(), batch.end());
+    assert(added == 2336 && m.size() == 7336);
+    assert(m.at(4) == 4 && m.at(7) == -1 && m.at(-5) == -1 && m.at(11998) == -1);
+    int prev = -6;
+    for (auto &kv : m) {
+        assert(kv.first > prev);
+        prev = kv.first;
+    }
+    assert(m.rbegin()->first == 11998 && (++m.rbegin())->first == 11995);
+
+    std::vector<int> keys {-5, 0, 1, 2, 3, 3, 11998, 20000};
+    assert(m.erase_sorted_batch(keys.begin(), keys.end()) == 5);
+    assert(!m.contains(0) && !m.contains(3) && m.contains(4) && m.size() == 7331);
+    std::vector<int> unsorted {100, 50, 4, 200};
+    assert(m.erase_sorted_batch(unsorted.begin(), unsorted.end()) == 4);
+    assert(m.begin()->first == -2 && !m.contains(100) && m.size() == 7327);
+
+    // with a hash index, and growing out of the inline entries
+    cs540::Map<std::string, double> hashed;
+    for (int i = 0; i < 2000; ++i) {
+        hashed.insert({"k" + std::to_string(i), i});
+    }
+    std::vector<std::string> names {"k1", "k10", "k100", "nope"};
+    assert(hashed.erase_sorted_batch(names.begin(), names.end()) == 3);
+    assert(!hashed.contains("k10") && hashed.contains("k1000") && hashed.size() == 1997);
+    cs540::Map<short, std::string> small {{2, "b"}};
+    std::vector<std::pair<short, std::string>> letters;
+    for (short i = 0; i < 100; ++i) {
+        letters.push_back({i, "x"});
+    }
+    assert(small.insert_sorted_batch(letters.begin(), letters.end()) == 99);
+    assert(small.size() == 100 && small.at(2) == "b" && (--small.end())->first == 99);
+}
+
+void buffered_map() {
+    cs540::Map<int, std::string> base {{1, "one"}, {2, "two"}, {3, "three"}};
+    cs540::BufferedMap<int, std::string> m(std::move(base), 4);
+    m.insert({2, "deux"}); // the map has 2 already
+    m.insert({4, "four"});
+    m.erase(3);
+    assert(m.at(2) == "two" && m.at(4) == "four" && !m.contains(3) && m.get_if(3) == nullptr);
+    m.erase(2);
+    m.insert({2, "zwei"}); // an insert after an erase replaces
+    assert(m.at(2) == "zwei" && m.contains(1));
+    bool thrown = false;
+    try {
+        m.at(3);
+    } catch (const std::out_of_range &) {
+        thrown = true;
+    }
+    assert(thrown);
+    m.insert({5, "five"});
+    assert(m.merged().size() == 4 && m.merged().at(2) == "zwei" && m.merged().find(3) == m.merged().end());
+
+    // reads in order merge the delta first
+    m.insert({0, "zero"});
+    m.erase(5);
+    std::string keys;
+    for (auto &kv : m) {
+        keys += std::to_string(kv.first);
+    }
+    assert(keys == "0124" && m.size() == 4 && m.lower_bound(3)->first == 4);
+    const cs540::BufferedMap<int, std::string> &cm = m;
+    m.erase(1);
+    assert(cm.begin()->first == 0 && cm.find(1) == cm.end());
+
+    cs540::BufferedMap<int, int> big(100);
+    for (int i = 0; i < 10000; ++i) {
+        big.insert({(i * 7919) % 10000, i});
+        if (i % 3 == 0) {
+            big.erase((i * 31) % 10000);
+        }
+    }
+    cs540::Map<int, int> plain;
+    for (int i = 0; i < 10000; ++i) {
+        plain.insert({(i * 7919) % 10000, i});
+        if (i % 3 == 0) {
+            plain.erase((i * 31) % 10000, std::nothrow);
+        }
+    }
+    assert(big.merged() == plain);
+
+    // lookups see the writes still in the log
+    cs540::BufferedMap<int, int> fresh;
+    fresh.insert({1, 10});
+    fresh.erase(1);
+    fresh.insert({1, 11});
+    fresh.insert({1, 12});
+    fresh.insert({2, 20});
+    fresh.erase(3);
+    assert(fresh.at(1) == 11 && fresh.at(2) == 20 && !fresh.contains(3) && fresh.get_if(3) == nullptr);
+    assert(fresh.find(1)->second == 11 && fresh.size() == 2);
+}
+
 int main () {
     count_words();
 
@@ -134,6 +1239,31 @@ int main () {
     assign_example = copy_example;
 
     access_by_key();
+    save_and_load();
+    bounds_and_freeze();
+    mapped_file();
+    copy_on_write();
+    snapshots();
+    merge_and_set_operations();
+    split_and_join();
+    span_counts();
+    node_handles();
+    compressed_links();
+    inline_entries();
+    static_map();
+    dense_map();
+    key_index();
+    next_key_cache();
+    separate_values();
+    forward_only();
+    non_throwing_lookups();
+    bloom_filter();
+    hash_index();
+    parallel_build();
+    parallel_scans();
+    parallel_copy_and_clear();
+    sorted_batches();
+    buffered_map();
     stress(10000);
 
     return 0;